@@ -36,6 +36,9 @@
   Or if you want to test UNIX sockets, run both on Raspberry Pi:
   socat UNIX-LISTEN:/tmp/remotebitbang-socket,fork EXEC:"sudo ./remote_bitbang_sysfsgpio tck 11 tms 25 tdo 9 tdi 10"
   openocd -c "interface remote_bitbang; remote_bitbang_host /tmp/remotebitbang-socket" -f target/stm32f1x.cfg
+
+  Besides the ASCII commands, this server understands the packed commands
+  (X, T, C and S) described in doc/manual/jtag/drivers/remote_bitbang.txt.
 */
 
 #include <sys/types.h>
@@ -291,6 +294,107 @@ static void cleanup_all_fds(void)
 	cleanup_fd(srst_fd, srst_gpio);
 }
 
+/*
+ * Read a little-endian number of size bytes. Returns -1 at the end of the
+ * input.
+ */
+static long read_le(int size)
+{
+	unsigned long value = 0;
+	for (int i = 0; i < size; i++) {
+		int c = getchar();
+		if (c == EOF)
+			return -1;
+		value |= (unsigned long)c << (8 * i);
+	}
+	return value;
+}
+
+/*
+ * T: clock out TMS bits with TDI low, and leave TCK low.
+ */
+static int process_packed_tms(void)
+{
+	long num_bits = read_le(2);
+	if (num_bits < 0)
+		return ERROR_FAIL;
+
+	int tms = 0;
+	int c = 0;
+	for (long i = 0; i < num_bits; i++) {
+		if (i % 8 == 0) {
+			c = getchar();
+			if (c == EOF)
+				return ERROR_FAIL;
+		}
+		tms = (c >> (i % 8)) & 1;
+		sysfsgpio_write(0, tms, 0);
+		sysfsgpio_write(1, tms, 0);
+	}
+	sysfsgpio_write(0, tms, 0);
+	return ERROR_OK;
+}
+
+/*
+ * C: run a number of clocks with a fixed TMS and TDI low, and leave TCK low.
+ */
+static int process_packed_clocks(void)
+{
+	int tms = getchar();
+	long num_cycles = read_le(4);
+	if (tms == EOF || num_cycles < 0)
+		return ERROR_FAIL;
+
+	for (long i = 0; i < num_cycles; i++) {
+		sysfsgpio_write(0, tms, 0);
+		sysfsgpio_write(1, tms, 0);
+	}
+	sysfsgpio_write(0, tms, 0);
+	return ERROR_OK;
+}
+
+/*
+ * S: shift a whole scan, and leave TCK high. The captured TDO bits are sent
+ * back at the end.
+ */
+static int process_packed_scan(void)
+{
+	int flags = getchar();
+	long num_bits = read_le(4);
+	if (flags == EOF || num_bits < 0)
+		return ERROR_FAIL;
+
+	size_t num_bytes = (num_bits + 7) / 8;
+	unsigned char *tdi = calloc(num_bytes ? num_bytes : 1, 1);
+	unsigned char *tdo = calloc(num_bytes ? num_bytes : 1, 1);
+	if (!tdi || !tdo) {
+		LOG_ERROR("Out of memory for a scan of %ld bits", num_bits);
+		free(tdi);
+		free(tdo);
+		return ERROR_FAIL;
+	}
+	if ((flags & 1) && fread(tdi, 1, num_bytes, stdin) != num_bytes) {
+		free(tdi);
+		free(tdo);
+		return ERROR_FAIL;
+	}
+
+	for (long i = 0; i < num_bits; i++) {
+		int tms = (flags & 4) && i == num_bits - 1;
+		int bit = (tdi[i / 8] >> (i % 8)) & 1;
+		sysfsgpio_write(0, tms, bit);
+		if ((flags & 2) && sysfsgpio_read() == '1')
+			tdo[i / 8] |= 1 << (i % 8);
+		sysfsgpio_write(1, tms, bit);
+	}
+
+	if (flags & 2)
+		fwrite(tdo, 1, num_bytes, stdout);
+	free(tdi);
+	free(tdo);
+	return ERROR_OK;
+}
+
 static void process_remote_protocol(void)
 {
 	int c;
@@ -311,7 +415,18 @@ static void process_remote_protocol(void)
 					(d & 1));
 		} else if (c == 'R')
 			putchar(sysfsgpio_read());
-		else
+		else if (c == 'X') /* Packed commands are supported */
+			putchar('X');
+		else if (c == 'T') { /* Packed TMS sequence */
+			if (process_packed_tms() != ERROR_OK)
+				break;
+		} else if (c == 'C') { /* Packed clocks */
+			if (process_packed_clocks() != ERROR_OK)
+				break;
+		} else if (c == 'S') { /* Packed scan */
+			if (process_packed_scan() != ERROR_OK)
+				break;
+		} else
 			LOG_ERROR("Unknown command '%c' received", c);
 	}
 }
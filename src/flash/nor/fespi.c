@@ -125,6 +125,9 @@ struct fespi_flash_bank {
 	int probed;
 	target_addr_t ctrl_base;
 	const struct flash_device *dev;
+	/* Stream data to the async loader instead of running the loader once
+	 * per chunk. */
+	bool async;
 };
 
 struct fespi_target {
@@ -158,10 +161,15 @@ FLASH_BANK_COMMAND_HANDLER(fespi_flash_bank_command)
 	bank->driver_priv = fespi_info;
 	fespi_info->probed = 0;
 	fespi_info->ctrl_base = 0;
-	if (CMD_ARGC >= 7) {
-		COMMAND_PARSE_ADDRESS(CMD_ARGV[6], fespi_info->ctrl_base);
-		LOG_DEBUG("ASSUMING FESPI device at ctrl_base = " TARGET_ADDR_FMT,
-				fespi_info->ctrl_base);
+	fespi_info->async = false;
+	for (unsigned i = 6; i < CMD_ARGC; i++) {
+		if (strcmp(CMD_ARGV[i], "async") == 0) {
+			fespi_info->async = true;
+		} else {
+			COMMAND_PARSE_ADDRESS(CMD_ARGV[i], fespi_info->ctrl_base);
+			LOG_DEBUG("ASSUMING FESPI device at ctrl_base = " TARGET_ADDR_FMT,
+					fespi_info->ctrl_base);
+		}
 	}
 
 	return ERROR_OK;
@@ -479,6 +487,118 @@ static const uint8_t riscv64_bin[] = {
 #include "../../../contrib/loaders/flash/fespi/riscv64_fespi.inc"
 };
 
+static const uint8_t riscv32_async_bin[] = {
+#include "../../../contrib/loaders/flash/fespi/riscv32_fespi_async.inc"
+};
+
+static const uint8_t riscv64_async_bin[] = {
+#include "../../../contrib/loaders/flash/fespi/riscv64_fespi_async.inc"
+};
+
+/* Number of flash pages that fit in the circular buffer, at most. */
+#define FESPI_ASYNC_FIFO_PAGES 64
+
+/* Write using the async loader, which programs flash out of a circular buffer
+ * in the working area while we keep filling it, so that the JTAG transfers
+ * overlap with flash programming. */
+static int fespi_write_async(struct flash_bank *bank, const uint8_t *buffer,
+		uint32_t offset, uint32_t count)
+{
+	struct target *target = bank->target;
+	struct fespi_flash_bank *fespi_info = bank->driver_priv;
+	struct working_area *algorithm_wa = NULL;
+	struct working_area *fifo_wa = NULL;
+	int retval;
+
+	int xlen = riscv_xlen(target);
+	const uint8_t *bin;
+	size_t bin_size;
+	if (xlen == 32) {
+		bin = riscv32_async_bin;
+		bin_size = sizeof(riscv32_async_bin);
+	} else {
+		bin = riscv64_async_bin;
+		bin_size = sizeof(riscv64_async_bin);
+	}
+
+	if (target_alloc_working_area(target, bin_size, &algorithm_wa) != ERROR_OK) {
+		LOG_WARNING("Couldn't allocate %zd-byte working area.", bin_size);
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	}
+
+	retval = target_write_buffer(target, algorithm_wa->address, bin_size, bin);
+	if (retval != ERROR_OK) {
+		LOG_ERROR("Failed to write code to " TARGET_ADDR_FMT ": %d",
+				algorithm_wa->address, retval);
+		target_free_working_area(target, algorithm_wa);
+		return retval;
+	}
+
+	/* If no valid page_size, use reasonable default. */
+	uint32_t page_size = fespi_info->dev->pagesize ?
+		fespi_info->dev->pagesize : SPIFLASH_DEF_PAGESIZE;
+
+	/* The buffer starts with the write and read pointers. Make room for at
+	 * least two pages, so one can be filled while the other is programmed. */
+	uint32_t fifo_pages = FESPI_ASYNC_FIFO_PAGES;
+	while (target_alloc_working_area_try(target, 8 + fifo_pages * page_size,
+				&fifo_wa) != ERROR_OK) {
+		fifo_pages /= 2;
+		if (fifo_pages < 2) {
+			LOG_WARNING("Couldn't allocate FIFO working area.");
+			target_free_working_area(target, algorithm_wa);
+			return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+		}
+	}
+
+	struct reg_param reg_params[6];
+	init_reg_param(&reg_params[0], "a0", xlen, PARAM_IN_OUT);
+	init_reg_param(&reg_params[1], "a1", xlen, PARAM_OUT);
+	init_reg_param(&reg_params[2], "a2", xlen, PARAM_OUT);
+	init_reg_param(&reg_params[3], "a3", xlen, PARAM_OUT);
+	init_reg_param(&reg_params[4], "a4", xlen, PARAM_OUT);
+	init_reg_param(&reg_params[5], "a5", xlen, PARAM_OUT);
+
+	buf_set_u64(reg_params[0].value, 0, xlen, fespi_info->ctrl_base);
+	buf_set_u64(reg_params[1].value, 0, xlen, page_size);
+	buf_set_u64(reg_params[2].value, 0, xlen, fifo_wa->address);
+	buf_set_u64(reg_params[3].value, 0, xlen, fifo_wa->address + fifo_wa->size);
+	buf_set_u64(reg_params[4].value, 0, xlen, offset);
+	buf_set_u64(reg_params[5].value, 0, xlen, count);
+
+	LOG_DEBUG("async write(ctrl_base=0x%" TARGET_PRIxADDR ", page_size=0x%x, "
+			"fifo=0x%" TARGET_PRIxADDR "+0x%x, offset=0x%" PRIx32
+			", count=0x%" PRIx32 ")", fespi_info->ctrl_base, page_size,
+			fifo_wa->address, fifo_wa->size, offset, count);
+
+	int64_t start = timeval_ms();
+	retval = target_run_flash_async_algorithm(target, buffer, count, 1,
+			0, NULL, ARRAY_SIZE(reg_params), reg_params,
+			fifo_wa->address, fifo_wa->size,
+			algorithm_wa->address, 0, NULL);
+	int64_t elapsed = timeval_ms() - start;
+
+	if (retval == ERROR_OK) {
+		int algorithm_result = buf_get_u64(reg_params[0].value, 0, xlen);
+		if (algorithm_result != 0) {
+			LOG_ERROR("Algorithm returned error %d", algorithm_result);
+			retval = ERROR_FAIL;
+		}
+	}
+
+	if (retval == ERROR_OK)
+		LOG_INFO("Programmed %" PRIu32 " bytes in %" PRId64 " ms (%" PRId64
+				" KiB/s)", count, elapsed,
+				elapsed ? (int64_t) count * 1000 / 1024 / elapsed : 0);
+
+	for (unsigned i = 0; i < ARRAY_SIZE(reg_params); i++)
+		destroy_reg_param(&reg_params[i]);
+	target_free_working_area(target, fifo_wa);
+	target_free_working_area(target, algorithm_wa);
+
+	return retval;
+}
+
 static int fespi_write(struct flash_bank *bank, const uint8_t *buffer,
 		uint32_t offset, uint32_t count)
 {
@@ -513,6 +633,17 @@ static int fespi_write(struct flash_bank *bank, const uint8_t *buffer,
 		}
 	}
 
+	if (fespi_info->async) {
+		retval = fespi_write_async(bank, buffer, offset, count);
+		if (retval != ERROR_TARGET_RESOURCE_NOT_AVAILABLE) {
+			/* Switch to HW mode before return to prompt */
+			if (retval != ERROR_OK)
+				fespi_enable_hw_mode(bank);
+			return retval;
+		}
+		LOG_WARNING("Falling back to running the loader once per chunk.");
+	}
+
 	int xlen = riscv_xlen(target);
 	struct working_area *algorithm_wa = NULL;
 	struct working_area *data_wa = NULL;
@@ -36,12 +36,24 @@
 struct cmd_queue_page {
 	struct cmd_queue_page *next;
 	void *address;
+	size_t size;
 	size_t used;
 };
 
 #define CMD_QUEUE_PAGE_SIZE (1024 * 1024)
+/* Pages are kept when the queue is reset, so that refilling the queue up to
+ * its largest size so far doesn't need malloc(). Allocations come from
+ * cmd_queue_page_current, and move on to the next page once it is full. */
 static struct cmd_queue_page *cmd_queue_pages;
-static struct cmd_queue_page *cmd_queue_pages_tail;
+static struct cmd_queue_page *cmd_queue_page_current;
+
+/* Buffers registered with jtag_add_out_buffer() until the queue is reset. */
+struct cmd_queue_out_buffer {
+	struct cmd_queue_out_buffer *next;
+	const uint8_t *address;
+	size_t size;
+};
+static struct cmd_queue_out_buffer *cmd_queue_out_buffers;
 
 struct jtag_command *jtag_command_queue;
 static struct jtag_command **next_command_pointer = &jtag_command_queue;
@@ -62,8 +74,7 @@ void jtag_queue_command(struct jtag_command *cmd)
 
 void *cmd_queue_alloc(size_t size)
 {
-	struct cmd_queue_page **p_page = &cmd_queue_pages;
-	int offset;
+	struct cmd_queue_page *page = cmd_queue_page_current;
 	uint8_t *t;
 
 	/*
@@ -98,30 +109,44 @@ void *cmd_queue_alloc(size_t size)
 	size = (size + ALIGN_SIZE - 1) & (~(ALIGN_SIZE - 1));
 	/* Done... */
 
-	if (*p_page) {
-		p_page = &cmd_queue_pages_tail;
-		if (CMD_QUEUE_PAGE_SIZE - (*p_page)->used < size)
-			p_page = &((*p_page)->next);
-	}
+	if (!page || page->size - page->used < size) {
+		struct cmd_queue_page *next = page ? page->next : cmd_queue_pages;
 
-	if (!*p_page) {
-		*p_page = malloc(sizeof(struct cmd_queue_page));
-		(*p_page)->used = 0;
-		size_t alloc_size = (size < CMD_QUEUE_PAGE_SIZE) ?
-					CMD_QUEUE_PAGE_SIZE : size;
-		(*p_page)->address = malloc(alloc_size);
-		(*p_page)->next = NULL;
-		cmd_queue_pages_tail = *p_page;
+		if (next && next->size >= size) {
+			/* reuse a page from an earlier queue */
+			next->used = 0;
+			page = next;
+		} else {
+			/* add a page after the current one */
+			struct cmd_queue_page *new_page = malloc(sizeof(struct cmd_queue_page));
+			if (!new_page)
+				return NULL;
+			new_page->size = (size < CMD_QUEUE_PAGE_SIZE) ?
+						CMD_QUEUE_PAGE_SIZE : size;
+			new_page->address = malloc(new_page->size);
+			if (!new_page->address) {
+				free(new_page);
+				return NULL;
+			}
+			new_page->used = 0;
+			new_page->next = next;
+			if (page)
+				page->next = new_page;
+			else
+				cmd_queue_pages = new_page;
+			page = new_page;
+		}
+		cmd_queue_page_current = page;
 	}
 
-	offset = (*p_page)->used;
-	(*p_page)->used += size;
+	t = page->address;
+	t += page->used;
+	page->used += size;
 
-	t = (*p_page)->address;
-	return t + offset;
+	return t;
 }
 
-static void cmd_queue_free(void)
+void jtag_command_queue_free(void)
 {
 	struct cmd_queue_page *page = cmd_queue_pages;
 
@@ -133,26 +158,68 @@ static void cmd_queue_free(void)
 	}
 
 	cmd_queue_pages = NULL;
-	cmd_queue_pages_tail = NULL;
+	cmd_queue_page_current = NULL;
+	cmd_queue_out_buffers = NULL;
+
+	jtag_command_queue = NULL;
+	next_command_pointer = &jtag_command_queue;
 }
 
 void jtag_command_queue_reset(void)
 {
-	cmd_queue_free();
+	/* rewind to the first page, keeping all of them for the next queue */
+	cmd_queue_page_current = cmd_queue_pages;
+	if (cmd_queue_page_current)
+		cmd_queue_page_current->used = 0;
+	cmd_queue_out_buffers = NULL;
 
 	jtag_command_queue = NULL;
 	next_command_pointer = &jtag_command_queue;
 }
 
+void jtag_add_out_buffer(const uint8_t *buffer, size_t size)
+{
+	struct cmd_queue_out_buffer *out = cmd_queue_alloc(sizeof(*out));
+	if (!out)
+		return;
+
+	out->address = buffer;
+	out->size = size;
+	out->next = cmd_queue_out_buffers;
+	cmd_queue_out_buffers = out;
+}
+
+/**
+ * Get an out value that stays valid until the queue is executed.
+ *
+ * This returns value itself if it lies in a buffer registered with
+ * jtag_add_out_buffer(), and otherwise a copy allocated with cmd_queue_alloc.
+ */
+const uint8_t *cmd_queue_out_value(const uint8_t *value, int num_bits)
+{
+	size_t size = DIV_ROUND_UP(num_bits, 8);
+
+	if (!value)
+		return NULL;
+
+	for (struct cmd_queue_out_buffer *out = cmd_queue_out_buffers; out; out = out->next) {
+		if (value >= out->address && value + size <= out->address + out->size)
+			return value;
+	}
+
+	return buf_cpy(value, cmd_queue_alloc(size), num_bits);
+}
+
 /**
  * Copy a struct scan_field for insertion into the queue.
  *
- * This allocates a new copy of out_value using cmd_queue_alloc.
+ * This copies out_value with cmd_queue_out_value(), so it is shared rather
+ * than copied when it lies in a buffer registered with jtag_add_out_buffer().
  */
 void jtag_scan_field_clone(struct scan_field *dst, const struct scan_field *src)
 {
 	dst->num_bits	= src->num_bits;
-	dst->out_value	= buf_cpy(src->out_value, cmd_queue_alloc(DIV_ROUND_UP(src->num_bits, 8)), src->num_bits);
+	dst->out_value	= cmd_queue_out_value(src->out_value, src->num_bits);
 	dst->in_value	= src->in_value;
 }
 
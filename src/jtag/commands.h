@@ -167,6 +167,9 @@ void *cmd_queue_alloc(size_t size);
 
 void jtag_queue_command(struct jtag_command *cmd);
 void jtag_command_queue_reset(void);
+/** Frees the memory that jtag_command_queue_reset() keeps for reuse. */
+void jtag_command_queue_free(void);
+const uint8_t *cmd_queue_out_value(const uint8_t *value, int num_bits);
 
 void jtag_scan_field_clone(struct scan_field *dst, const struct scan_field *src);
 enum scan_type jtag_scan_type(const struct scan_command *cmd);
@@ -1494,6 +1494,8 @@ int adapter_quit(void)
 		t = n;
 	}
 
+	jtag_command_queue_free();
+
 	return ERROR_OK;
 }
 
@@ -51,6 +51,8 @@ static volatile uint32_t *pio_base;
 
 static bb_value_t bcm2835gpio_read(void);
 static int bcm2835gpio_write(int tck, int tms, int tdi);
+static int bcm2835gpio_write_bits(const uint8_t *tms, const uint8_t *tdi,
+		uint8_t *tdo, unsigned num_bits);
 static int bcm2835gpio_reset(int trst, int srst);
 
 static int bcm2835_swdio_read(void);
@@ -62,6 +64,7 @@ static int bcm2835gpio_quit(void);
 static struct bitbang_interface bcm2835gpio_bitbang = {
 	.read = bcm2835gpio_read,
 	.write = bcm2835gpio_write,
+	.write_bits = bcm2835gpio_write_bits,
 	.reset = bcm2835gpio_reset,
 	.swdio_read = bcm2835_swdio_read,
 	.swdio_drive = bcm2835_swdio_drive,
@@ -110,6 +113,24 @@ static int bcm2835gpio_write(int tck, int tms, int tdi)
 	return ERROR_OK;
 }
 
+static int bcm2835gpio_write_bits(const uint8_t *tms, const uint8_t *tdi,
+		uint8_t *tdo, unsigned num_bits)
+{
+	for (unsigned i = 0; i < num_bits; i++) {
+		int tms_bit = (tms[i / 8] >> (i % 8)) & 1;
+		int tdi_bit = (tdi[i / 8] >> (i % 8)) & 1;
+		bcm2835gpio_write(0, tms_bit, tdi_bit);
+		if (tdo) {
+			if (GPIO_LEV & 1 << tdo_gpio)
+				tdo[i / 8] |= 1 << (i % 8);
+			else
+				tdo[i / 8] &= ~(1 << (i % 8));
+		}
+		bcm2835gpio_write(1, tms_bit, tdi_bit);
+	}
+	return ERROR_OK;
+}
+
 static int bcm2835gpio_swd_write(int tck, int tms, int tdi)
 {
 	uint32_t set = tck<<swclk_gpio | tdi<<swdio_gpio;
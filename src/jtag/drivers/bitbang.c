@@ -200,6 +200,37 @@ static int bitbang_stableclocks(int num_cycles)
 	return ERROR_OK;
 }
 
+/* TMS and all-zero TDI vectors for bitbang_scan_bits(), kept between scans. */
+static uint8_t *bitbang_tms_bits;
+static uint8_t *bitbang_zero_bits;
+static size_t bitbang_bits_size;
+
+/* Hand the whole scan to write_bits(). TMS is high for the last bit only. */
+static int bitbang_scan_bits(enum scan_type type, uint8_t *buffer,
+		unsigned scan_size)
+{
+	size_t size = DIV_ROUND_UP(scan_size, 8);
+	if (size > bitbang_bits_size) {
+		free(bitbang_tms_bits);
+		free(bitbang_zero_bits);
+		bitbang_tms_bits = malloc(size);
+		bitbang_zero_bits = calloc(size, 1);
+		if (!bitbang_tms_bits || !bitbang_zero_bits) {
+			LOG_ERROR("Out of memory for a scan of %u bits", scan_size);
+			bitbang_bits_size = 0;
+			return ERROR_FAIL;
+		}
+		bitbang_bits_size = size;
+	}
+	memset(bitbang_tms_bits, 0, size);
+	buf_set_u32(bitbang_tms_bits, scan_size - 1, 1, 1);
+
+	/* When just reading, output 'low' like the bit by bit loop does. */
+	const uint8_t *tdi = type == SCAN_IN ? bitbang_zero_bits : buffer;
+	uint8_t *tdo = type == SCAN_OUT ? NULL : buffer;
+	return bitbang_interface->write_bits(bitbang_tms_bits, tdi, tdo, scan_size);
+}
+
 static int bitbang_scan(bool ir_scan, enum scan_type type, uint8_t *buffer,
 		unsigned scan_size)
 {
@@ -219,6 +250,12 @@ static int bitbang_scan(bool ir_scan, enum scan_type type, uint8_t *buffer,
 		bitbang_end_state(saved_end_state);
 	}
 
+	if (bitbang_interface->write_bits && scan_size) {
+		if (bitbang_scan_bits(type, buffer, scan_size) != ERROR_OK)
+			return ERROR_FAIL;
+		scan_size = 0;
+	}
+
 	size_t buffered = 0;
 	for (bit_cnt = 0; bit_cnt < scan_size; bit_cnt++) {
 		int tms = (bit_cnt == scan_size-1) ? 1 : 0;
@@ -51,6 +51,14 @@ struct bitbang_interface {
 
 	/** Set TCK, TMS, and TDI to the given values. */
 	int (*write)(int tck, int tms, int tdi);
+
+	/** Clock a whole JTAG scan of num_bits bits, least significant bit of the
+	 * first byte first. Each bit puts its TMS and TDI values on the pins with
+	 * TCK low, samples TDO into tdo (unless tdo is NULL) and raises TCK, and
+	 * TCK is left high. tdo may be the same buffer as tdi. Optional; it saves
+	 * the calls to write() and sample() for every bit. */
+	int (*write_bits)(const uint8_t *tms, const uint8_t *tdi, uint8_t *tdo,
+			unsigned num_bits);
 	int (*reset)(int trst, int srst);
 	int (*blink)(int on);
 	int (*swdio_read)(void);
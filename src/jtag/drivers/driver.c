@@ -197,7 +197,7 @@ static int jtag_add_plain_scan(int num_bits, const uint8_t *out_bits,
 	scan->end_state = state;
 
 	out_fields->num_bits = num_bits;
-	out_fields->out_value = buf_cpy(out_bits, cmd_queue_alloc(DIV_ROUND_UP(num_bits, 8)), num_bits);
+	out_fields->out_value = cmd_queue_out_value(out_bits, num_bits);
 	out_fields->in_value = in_bits;
 
 	return ERROR_OK;
@@ -84,6 +84,8 @@ static inline bool gpio_level(int g)
 
 static bb_value_t imx_gpio_read(void);
 static int imx_gpio_write(int tck, int tms, int tdi);
+static int imx_gpio_write_bits(const uint8_t *tms, const uint8_t *tdi,
+		uint8_t *tdo, unsigned num_bits);
 static int imx_gpio_reset(int trst, int srst);
 
 static int imx_gpio_swdio_read(void);
@@ -95,6 +97,7 @@ static int imx_gpio_quit(void);
 static struct bitbang_interface imx_gpio_bitbang = {
 	.read = imx_gpio_read,
 	.write = imx_gpio_write,
+	.write_bits = imx_gpio_write_bits,
 	.reset = imx_gpio_reset,
 	.swdio_read = imx_gpio_swdio_read,
 	.swdio_drive = imx_gpio_swdio_drive,
@@ -145,6 +148,24 @@ static int imx_gpio_write(int tck, int tms, int tdi)
 	return ERROR_OK;
 }
 
+static int imx_gpio_write_bits(const uint8_t *tms, const uint8_t *tdi,
+		uint8_t *tdo, unsigned num_bits)
+{
+	for (unsigned i = 0; i < num_bits; i++) {
+		int tms_bit = (tms[i / 8] >> (i % 8)) & 1;
+		int tdi_bit = (tdi[i / 8] >> (i % 8)) & 1;
+		imx_gpio_write(0, tms_bit, tdi_bit);
+		if (tdo) {
+			if (gpio_level(tdo_gpio))
+				tdo[i / 8] |= 1 << (i % 8);
+			else
+				tdo[i / 8] &= ~(1 << (i % 8));
+		}
+		imx_gpio_write(1, tms_bit, tdi_bit);
+	}
+	return ERROR_OK;
+}
+
 static int imx_gpio_swd_write(int tck, int tms, int tdi)
 {
 	tdi ? gpio_set(swdio_gpio) : gpio_clear(swdio_gpio);
@@ -46,6 +46,31 @@
 #define CMD_SCAN_CHAIN		2
 #define CMD_SCAN_CHAIN_FLIP_TMS	3
 #define CMD_STOP_SIMU		4
+#define CMD_VERSION		5
+
+/*
+ * Protocol version 1 sends every command as a struct vpi_cmd, and waits for
+ * the struct vpi_cmd that the server sends back after every scan.
+ *
+ * Version 2 is negotiated by jtag_vpi_negotiate(). Every command is then a
+ * frame of an 8 byte header followed by the TMS or TDI bits, if any:
+ *	u8 cmd, u8 flags, u8 reserved[2], u32 nb_bits (little endian)
+ * A scan only gets a reply when it has JTAG_VPI_CAPTURE set, and the reply is
+ * just the DIV_ROUND_UP(nb_bits, 8) bytes of TDO. Scans have no size limit.
+ */
+#define JTAG_VPI_PROTOCOL_VERSION	2
+
+/* Version 2 frame flags. */
+#define JTAG_VPI_CAPTURE	1	/* reply with the TDO bits */
+#define JTAG_VPI_TDI_HIGH	2	/* no TDI bits follow, TDI is high */
+
+#define JTAG_VPI_FRAME_HEADER	8
+
+/* Frames are sent once this many bytes are buffered, and replies are read
+ * once this many bytes are outstanding, so neither end blocks on a full
+ * socket buffer. */
+#define JTAG_VPI_MAX_BUFFERED	(64 * 1024)
+#define JTAG_VPI_MAX_PENDING	(16 * 1024)
 
 int server_port = SERVER_PORT;
 char *server_address;
@@ -53,6 +78,28 @@ char *server_address;
 int sockfd;
 struct sockaddr_in serv_addr;
 
+/* Highest protocol version to ask for, and the one in use. Servers that only
+ * know version 1 may stop the simulation on CMD_VERSION, so asking for more
+ * is left to "jtag_vpi_set_protocol". */
+static int protocol_max = 1;
+static int protocol = 1;
+
+/* Version 2 frames waiting to be sent. */
+static uint8_t *frames;
+static size_t frames_used;
+static size_t frames_size;
+
+/* Version 2 scans waiting for their TDO bits, in the order they were sent. */
+struct jtag_vpi_pending {
+	struct scan_command *cmd;
+	uint8_t *buf;
+	int nb_bits;
+};
+static struct jtag_vpi_pending *pending;
+static unsigned pending_count;
+static unsigned pending_size;
+static size_t pending_bytes;
+
 struct vpi_cmd {
 	int cmd;
 	unsigned char buffer_out[XFERT_MAX_SIZE];
@@ -61,8 +108,103 @@ struct vpi_cmd {
 	int nb_bits;
 };
 
+static int jtag_vpi_write(const void *data, size_t size)
+{
+	const char *p = data;
+	while (size) {
+		int retval = write_socket(sockfd, p, size);
+		if (retval <= 0)
+			return ERROR_FAIL;
+		p += retval;
+		size -= retval;
+	}
+	return ERROR_OK;
+}
+
+static int jtag_vpi_read(void *data, size_t size)
+{
+	char *p = data;
+	while (size) {
+		int retval = read_socket(sockfd, p, size);
+		if (retval <= 0)
+			return ERROR_FAIL;
+		p += retval;
+		size -= retval;
+	}
+	return ERROR_OK;
+}
+
+/* Send the buffered version 2 frames. */
+static int jtag_vpi_flush(void)
+{
+	int retval = jtag_vpi_write(frames, frames_used);
+	frames_used = 0;
+	return retval;
+}
+
+/**
+ * jtag_vpi_frame - buffer a version 2 frame
+ * @cmd: command
+ * @flags: JTAG_VPI_CAPTURE and/or JTAG_VPI_TDI_HIGH
+ * @bits: TMS or TDI bits, or NULL if none follow
+ * @nb_bits: number of bits
+ */
+static int jtag_vpi_frame(int cmd, int flags, const uint8_t *bits, int nb_bits)
+{
+	size_t nb_bytes = bits ? DIV_ROUND_UP(nb_bits, 8) : 0;
+	size_t size = JTAG_VPI_FRAME_HEADER + nb_bytes;
+
+	if (frames_used + size > frames_size) {
+		size_t new_size = MAX(frames_used + size, 2 * frames_size);
+		uint8_t *new_frames = realloc(frames, new_size);
+		if (!new_frames) {
+			LOG_ERROR("Out of memory");
+			return ERROR_FAIL;
+		}
+		frames = new_frames;
+		frames_size = new_size;
+	}
+
+	uint8_t *frame = frames + frames_used;
+	frame[0] = cmd;
+	frame[1] = flags;
+	frame[2] = 0;
+	frame[3] = 0;
+	h_u32_to_le(frame + 4, nb_bits);
+	if (nb_bytes)
+		memcpy(frame + JTAG_VPI_FRAME_HEADER, bits, nb_bytes);
+	frames_used += size;
+
+	if (frames_used >= JTAG_VPI_MAX_BUFFERED)
+		return jtag_vpi_flush();
+	return ERROR_OK;
+}
+
+/* Read the TDO bits of the pending version 2 scans, in order. */
+static int jtag_vpi_collect(void)
+{
+	int retval = jtag_vpi_flush();
+
+	for (unsigned i = 0; i < pending_count; i++) {
+		if (retval == ERROR_OK)
+			retval = jtag_vpi_read(pending[i].buf,
+					DIV_ROUND_UP(pending[i].nb_bits, 8));
+		if (retval == ERROR_OK)
+			retval = jtag_read_buffer(pending[i].buf, pending[i].cmd);
+		free(pending[i].buf);
+	}
+	pending_count = 0;
+	pending_bytes = 0;
+
+	return retval;
+}
+
 static int jtag_vpi_send_cmd(struct vpi_cmd *vpi)
 {
+	if (protocol >= 2)
+		return jtag_vpi_frame(vpi->cmd, 0, vpi->length ? vpi->buffer_out : NULL,
+				vpi->nb_bits);
+
 	int retval = write_socket(sockfd, vpi, sizeof(struct vpi_cmd));
 	if (retval <= 0)
 		return ERROR_FAIL;
@@ -90,6 +232,7 @@ static int jtag_vpi_reset(int trst, int srst)
 
 	vpi.cmd = CMD_RESET;
 	vpi.length = 0;
+	vpi.nb_bits = 0;
 	return jtag_vpi_send_cmd(&vpi);
 }
 
@@ -210,6 +353,12 @@ static int jtag_vpi_queue_tdi(uint8_t *bits, int nb_bits, int tap_shift)
 	int nb_xfer = DIV_ROUND_UP(nb_bits, XFERT_MAX_SIZE * 8);
 	int retval;
 
+	if (protocol >= 2) {
+		/* Version 2 has no size limit, and no reply is needed. */
+		return jtag_vpi_frame(tap_shift ? CMD_SCAN_CHAIN_FLIP_TMS : CMD_SCAN_CHAIN,
+				bits ? 0 : JTAG_VPI_TDI_HIGH, bits, nb_bits);
+	}
+
 	while (nb_xfer) {
 		if (nb_xfer ==  1) {
 			retval = jtag_vpi_queue_tdi_xfer(bits, nb_bits, tap_shift);
@@ -230,6 +379,47 @@ static int jtag_vpi_queue_tdi(uint8_t *bits, int nb_bits, int tap_shift)
 	return ERROR_OK;
 }
 
+/**
+ * jtag_vpi_queue_capture - queue a version 2 scan that captures TDO
+ * @cmd: the scan command
+ * @buf: buffer built by jtag_build_buffer(), which is freed once the TDO bits
+ *       have been read
+ * @nb_bits: number of bits
+ * @tap_shift: TAP_SHIFT to leave the shift state on the last bit
+ *
+ * The TDO bits are read by jtag_vpi_collect(), without waiting for them here.
+ */
+static int jtag_vpi_queue_capture(struct scan_command *cmd, uint8_t *buf,
+		int nb_bits, int tap_shift)
+{
+	if (pending_count == pending_size) {
+		unsigned new_size = pending_size ? 2 * pending_size : 16;
+		struct jtag_vpi_pending *new_pending = realloc(pending,
+				new_size * sizeof(*pending));
+		if (!new_pending) {
+			LOG_ERROR("Out of memory");
+			free(buf);
+			return ERROR_FAIL;
+		}
+		pending = new_pending;
+		pending_size = new_size;
+	}
+	pending[pending_count].cmd = cmd;
+	pending[pending_count].buf = buf;
+	pending[pending_count].nb_bits = nb_bits;
+	pending_count++;
+	pending_bytes += DIV_ROUND_UP(nb_bits, 8);
+
+	int retval = jtag_vpi_frame(tap_shift ? CMD_SCAN_CHAIN_FLIP_TMS : CMD_SCAN_CHAIN,
+			JTAG_VPI_CAPTURE, buf, nb_bits);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (pending_bytes >= JTAG_VPI_MAX_PENDING)
+		return jtag_vpi_collect();
+	return ERROR_OK;
+}
+
 /**
  * jtag_vpi_clock_tms - clock a TMS transition
  * @tms: the TMS to be sent
@@ -257,6 +447,7 @@ static int jtag_vpi_scan(struct scan_command *cmd)
 	int scan_bits;
 	uint8_t *buf = NULL;
 	int retval = ERROR_OK;
+	bool deferred = protocol >= 2 && jtag_scan_type(cmd) != SCAN_OUT;
 
 	scan_bits = jtag_build_buffer(cmd, &buf);
 
@@ -270,15 +461,13 @@ static int jtag_vpi_scan(struct scan_command *cmd)
 			return retval;
 	}
 
-	if (cmd->end_state == TAP_DRSHIFT) {
-		retval = jtag_vpi_queue_tdi(buf, scan_bits, NO_TAP_SHIFT);
-		if (retval != ERROR_OK)
-			return retval;
-	} else {
-		retval = jtag_vpi_queue_tdi(buf, scan_bits, TAP_SHIFT);
-		if (retval != ERROR_OK)
-			return retval;
-	}
+	int tap_shift = cmd->end_state == TAP_DRSHIFT ? NO_TAP_SHIFT : TAP_SHIFT;
+	if (deferred)
+		retval = jtag_vpi_queue_capture(cmd, buf, scan_bits, tap_shift);
+	else
+		retval = jtag_vpi_queue_tdi(buf, scan_bits, tap_shift);
+	if (retval != ERROR_OK)
+		return retval;
 
 	if (cmd->end_state != TAP_DRSHIFT) {
 		/*
@@ -295,12 +484,14 @@ static int jtag_vpi_scan(struct scan_command *cmd)
 			tap_set_state(TAP_DRPAUSE);
 	}
 
-	retval = jtag_read_buffer(buf, cmd);
-	if (retval != ERROR_OK)
-		return retval;
+	if (!deferred) {
+		retval = jtag_read_buffer(buf, cmd);
+		if (retval != ERROR_OK)
+			return retval;
 
-	if (buf)
-		free(buf);
+		if (buf)
+			free(buf);
+	}
 
 	if (cmd->end_state != TAP_DRSHIFT) {
 		retval = jtag_vpi_state_move(cmd->end_state);
@@ -359,6 +550,8 @@ static int jtag_vpi_execute_queue(void)
 			retval = jtag_vpi_tms(cmd->cmd.tms);
 			break;
 		case JTAG_SLEEP:
+			if (protocol >= 2)
+				retval = jtag_vpi_collect();
 			jtag_sleep(cmd->cmd.sleep->us);
 			break;
 		case JTAG_SCAN:
@@ -367,9 +560,56 @@ static int jtag_vpi_execute_queue(void)
 		}
 	}
 
+	if (protocol >= 2) {
+		/* Read the pending scans even after an error, to keep in sync. */
+		int collected = jtag_vpi_collect();
+		if (retval == ERROR_OK)
+			retval = collected;
+	}
+
 	return retval;
 }
 
+/*
+ * Ask the server for a newer protocol version, if "jtag_vpi_set_protocol"
+ * allows it. CMD_VERSION carries the highest version OpenOCD supports in
+ * nb_bits, and is followed by an empty scan. A version 1 server that ignores
+ * CMD_VERSION just answers the scan, but others may stop the simulation. A newer server first answers CMD_VERSION with a struct
+ * vpi_cmd holding CMD_VERSION and the version to use in nb_bits, then answers
+ * the scan, and uses that version for everything after the scan.
+ */
+static int jtag_vpi_negotiate(void)
+{
+	struct vpi_cmd vpi;
+
+	protocol = 1;
+	if (protocol_max < 2)
+		return ERROR_OK;
+
+	memset(&vpi, 0, sizeof(vpi));
+	vpi.cmd = CMD_VERSION;
+	vpi.nb_bits = protocol_max;
+	if (jtag_vpi_send_cmd(&vpi) != ERROR_OK)
+		return ERROR_FAIL;
+
+	memset(&vpi, 0, sizeof(vpi));
+	vpi.cmd = CMD_SCAN_CHAIN;
+	if (jtag_vpi_send_cmd(&vpi) != ERROR_OK)
+		return ERROR_FAIL;
+
+	if (jtag_vpi_receive_cmd(&vpi) != ERROR_OK)
+		return ERROR_FAIL;
+	if (vpi.cmd == CMD_VERSION) {
+		int version = MIN(vpi.nb_bits, protocol_max);
+		if (jtag_vpi_receive_cmd(&vpi) != ERROR_OK)
+			return ERROR_FAIL;
+		protocol = MAX(version, 1);
+	}
+
+	LOG_INFO("Using jtag_vpi protocol version %d", protocol);
+	return ERROR_OK;
+}
+
 static int jtag_vpi_init(void)
 {
 	int flag = 1;
@@ -410,12 +650,19 @@ static int jtag_vpi_init(void)
 
 	LOG_INFO("Connection to %s : %u succeed", server_address, server_port);
 
-	return ERROR_OK;
+	return jtag_vpi_negotiate();
 }
 
 static int jtag_vpi_quit(void)
 {
 	free(server_address);
+	free(frames);
+	frames = NULL;
+	frames_used = 0;
+	frames_size = 0;
+	free(pending);
+	pending = NULL;
+	pending_size = 0;
 	return close(sockfd);
 }
 
@@ -446,6 +693,23 @@ COMMAND_HANDLER(jtag_vpi_set_address)
 	return ERROR_OK;
 }
 
+COMMAND_HANDLER(jtag_vpi_set_protocol)
+{
+	if (CMD_ARGC != 1)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	int version;
+	COMMAND_PARSE_NUMBER(int, CMD_ARGV[0], version);
+	if (version < 1 || version > JTAG_VPI_PROTOCOL_VERSION) {
+		LOG_ERROR("Protocol version must be between 1 and %d",
+				JTAG_VPI_PROTOCOL_VERSION);
+		return ERROR_COMMAND_ARGUMENT_INVALID;
+	}
+	protocol_max = version;
+
+	return ERROR_OK;
+}
+
 static const struct command_registration jtag_vpi_command_handlers[] = {
 	{
 		.name = "jtag_vpi_set_port",
@@ -461,6 +725,13 @@ static const struct command_registration jtag_vpi_command_handlers[] = {
 		.help = "set the address of the VPI server",
 		.usage = "description_string",
 	},
+	{
+		.name = "jtag_vpi_set_protocol",
+		.handler = &jtag_vpi_set_protocol,
+		.mode = COMMAND_CONFIG,
+		.help = "set the highest protocol version to ask the VPI server for",
+		.usage = "version",
+	},
 	COMMAND_REGISTRATION_DONE
 };
 
@@ -25,14 +25,26 @@
 #include <netdb.h>
 #endif
 #include <jtag/interface.h>
+#include <jtag/commands.h>
 #include "bitbang.h"
 
 /* arbitrary limit on host name length: */
 #define REMOTE_BITBANG_HOST_MAX 255
 
+/* Captured bytes that may be outstanding before the replies are read. This
+ * keeps both ends from blocking on full socket buffers. */
+#define REMOTE_BITBANG_MAX_PENDING	(16 * 1024)
+/* Bits that remote_bitbang_write_bits() sends before reading the replies. */
+#define REMOTE_BITBANG_CHUNK_BITS	1024
+
 static char *remote_bitbang_host;
 static char *remote_bitbang_port;
 
+/* Try to use the packed commands. See remote_bitbang_negotiate(). */
+static bool remote_bitbang_use_packed = true;
+/* The server understands the packed commands. */
+static bool remote_bitbang_packed;
+
 static FILE *remote_bitbang_file;
 static int remote_bitbang_fd;
 
@@ -95,6 +107,40 @@ static int remote_bitbang_putc(int c)
 	return ERROR_OK;
 }
 
+static int remote_bitbang_put(const void *data, size_t size)
+{
+	if (fwrite(data, 1, size, remote_bitbang_file) != size) {
+		LOG_ERROR("remote_bitbang_put: %s", strerror(errno));
+		return ERROR_FAIL;
+	}
+	return ERROR_OK;
+}
+
+static int remote_bitbang_flush(void)
+{
+	if (EOF == fflush(remote_bitbang_file)) {
+		LOG_ERROR("fflush: %s", strerror(errno));
+		return ERROR_FAIL;
+	}
+	return ERROR_OK;
+}
+
+/* Read exactly size bytes of replies. */
+static int remote_bitbang_get(uint8_t *data, size_t size)
+{
+	socket_block(remote_bitbang_fd);
+	while (size) {
+		ssize_t count = read(remote_bitbang_fd, data, size);
+		if (count <= 0) {
+			LOG_ERROR("read: count=%d, error=%s", (int) count, strerror(errno));
+			return ERROR_FAIL;
+		}
+		data += count;
+		size -= count;
+	}
+	return ERROR_OK;
+}
+
 static int remote_bitbang_quit(void)
 {
 	if (EOF == fputc('Q', remote_bitbang_file)) {
@@ -194,8 +240,55 @@ static int remote_bitbang_blink(int on)
 	return remote_bitbang_putc(c);
 }
 
+/* Send the ASCII commands for a chunk of a scan at once, and read the replies
+ * of the whole chunk at once. */
+static int remote_bitbang_write_bits(const uint8_t *tms, const uint8_t *tdi,
+		uint8_t *tdo, unsigned num_bits)
+{
+	char commands[3 * REMOTE_BITBANG_CHUNK_BITS];
+	char replies[REMOTE_BITBANG_CHUNK_BITS];
+
+	/* bitbang_scan() reads every sample it asks for. */
+	assert(remote_bitbang_start == remote_bitbang_end);
+
+	for (unsigned offset = 0; offset < num_bits; offset += REMOTE_BITBANG_CHUNK_BITS) {
+		unsigned count = MIN(num_bits - offset, REMOTE_BITBANG_CHUNK_BITS);
+		size_t length = 0;
+		for (unsigned i = offset; i < offset + count; i++) {
+			char c = '0' + (((tms[i / 8] >> (i % 8)) & 1) ? 0x2 : 0x0) +
+				(((tdi[i / 8] >> (i % 8)) & 1) ? 0x1 : 0x0);
+			commands[length++] = c;
+			if (tdo)
+				commands[length++] = 'R';
+			commands[length++] = c + 0x4;
+		}
+		if (remote_bitbang_put(commands, length) != ERROR_OK)
+			return ERROR_FAIL;
+		if (!tdo)
+			continue;
+
+		if (remote_bitbang_flush() != ERROR_OK ||
+				remote_bitbang_get((uint8_t *)replies, count) != ERROR_OK)
+			return ERROR_FAIL;
+		for (unsigned i = 0; i < count; i++) {
+			switch (char_to_int(replies[i])) {
+				case BB_LOW:
+					tdo[(offset + i) / 8] &= ~(1 << ((offset + i) % 8));
+					break;
+				case BB_HIGH:
+					tdo[(offset + i) / 8] |= 1 << ((offset + i) % 8);
+					break;
+				default:
+					return ERROR_FAIL;
+			}
+		}
+	}
+	return ERROR_OK;
+}
+
 static struct bitbang_interface remote_bitbang_bitbang = {
 	.buf_size = sizeof(remote_bitbang_buf) - 1,
+	.write_bits = &remote_bitbang_write_bits,
 	.sample = &remote_bitbang_sample,
 	.read_sample = &remote_bitbang_read_sample,
 	.write = &remote_bitbang_write,
@@ -203,6 +296,282 @@ static struct bitbang_interface remote_bitbang_bitbang = {
 	.blink = &remote_bitbang_blink,
 };
 
+/*
+ * Packed commands. See doc/manual/jtag/drivers/remote_bitbang.txt for the
+ * encoding. Every command leaves TCK low, except for a scan which leaves it
+ * high like bitbang_scan() does, so the state move that follows completes
+ * the last clock.
+ */
+
+static int remote_bitbang_packed_tms(const uint8_t *bits, unsigned offset,
+		unsigned num_bits)
+{
+	do {
+		unsigned count = MIN(num_bits, 0xffff);
+		uint8_t header[3] = { 'T', count & 0xff, count >> 8 };
+		if (remote_bitbang_put(header, sizeof(header)) != ERROR_OK)
+			return ERROR_FAIL;
+		for (unsigned i = 0; i < DIV_ROUND_UP(count, 8); i++) {
+			uint8_t byte = buf_get_u32(bits, offset + 8 * i, MIN(8, count - 8 * i));
+			if (remote_bitbang_put(&byte, 1) != ERROR_OK)
+				return ERROR_FAIL;
+		}
+		offset += count;
+		num_bits -= count;
+	} while (num_bits);
+	return ERROR_OK;
+}
+
+static int remote_bitbang_packed_state_move(int skip)
+{
+	uint8_t tms_scan = tap_get_tms_path(tap_get_state(), tap_get_end_state());
+	int tms_count = tap_get_tms_path_len(tap_get_state(), tap_get_end_state());
+
+	if (remote_bitbang_packed_tms(&tms_scan, skip, tms_count - skip) != ERROR_OK)
+		return ERROR_FAIL;
+	tap_set_state(tap_get_end_state());
+	return ERROR_OK;
+}
+
+static int remote_bitbang_packed_clocks(int tms, unsigned num_cycles)
+{
+	uint8_t command[6] = { 'C', tms };
+	h_u32_to_le(command + 2, num_cycles);
+	return remote_bitbang_put(command, sizeof(command));
+}
+
+static int remote_bitbang_packed_runtest(unsigned num_cycles, tap_state_t end_state)
+{
+	if (tap_get_state() != TAP_IDLE) {
+		tap_set_end_state(TAP_IDLE);
+		if (remote_bitbang_packed_state_move(0) != ERROR_OK)
+			return ERROR_FAIL;
+	}
+	if (remote_bitbang_packed_clocks(0, num_cycles) != ERROR_OK)
+		return ERROR_FAIL;
+	tap_set_end_state(end_state);
+	if (tap_get_state() != tap_get_end_state())
+		return remote_bitbang_packed_state_move(0);
+	return ERROR_OK;
+}
+
+static int remote_bitbang_packed_path_move(struct pathmove_command *cmd)
+{
+	uint8_t bits[DIV_ROUND_UP(32, 8)];
+	int done = 0;
+	while (done < cmd->num_states) {
+		unsigned count = MIN(cmd->num_states - done, 32);
+		memset(bits, 0, sizeof(bits));
+		for (unsigned i = 0; i < count; i++) {
+			tap_state_t next = cmd->path[done + i];
+			if (tap_state_transition(tap_get_state(), true) == next) {
+				bits[i / 8] |= 1 << (i % 8);
+			} else if (tap_state_transition(tap_get_state(), false) != next) {
+				LOG_ERROR("BUG: %s -> %s isn't a valid TAP transition",
+						tap_state_name(tap_get_state()), tap_state_name(next));
+				exit(-1);
+			}
+			tap_set_state(next);
+		}
+		if (remote_bitbang_packed_tms(bits, 0, count) != ERROR_OK)
+			return ERROR_FAIL;
+		done += count;
+	}
+	tap_set_end_state(tap_get_state());
+	return ERROR_OK;
+}
+
+/* A scan whose captured bits haven't been read yet. */
+struct remote_bitbang_pending {
+	struct scan_command *command;
+	uint8_t *buffer;
+	int size;
+};
+
+static int remote_bitbang_packed_scan(struct scan_command *cmd, uint8_t *buffer,
+		int scan_size)
+{
+	tap_state_t shift_state = cmd->ir_scan ? TAP_IRSHIFT : TAP_DRSHIFT;
+	if (tap_get_state() != shift_state) {
+		tap_set_end_state(shift_state);
+		if (remote_bitbang_packed_state_move(0) != ERROR_OK)
+			return ERROR_FAIL;
+	}
+	tap_set_end_state(cmd->end_state);
+
+	enum scan_type type = jtag_scan_type(cmd);
+	uint8_t header[6] = { 'S', 4 };
+	if (type != SCAN_IN)
+		header[1] |= 1;
+	if (type != SCAN_OUT)
+		header[1] |= 2;
+	h_u32_to_le(header + 2, scan_size);
+	if (remote_bitbang_put(header, sizeof(header)) != ERROR_OK)
+		return ERROR_FAIL;
+	if (type != SCAN_IN &&
+			remote_bitbang_put(buffer, DIV_ROUND_UP(scan_size, 8)) != ERROR_OK)
+		return ERROR_FAIL;
+
+	/* The scan left the shift state, so skip the first step. */
+	if (tap_get_state() != tap_get_end_state())
+		return remote_bitbang_packed_state_move(1);
+	return ERROR_OK;
+}
+
+/* Read the captured bits of the pending scans, in the order they were sent. */
+static int remote_bitbang_collect(struct remote_bitbang_pending *pending,
+		unsigned *count, int *retval)
+{
+	int result = ERROR_OK;
+	if (*count && remote_bitbang_flush() != ERROR_OK)
+		result = ERROR_FAIL;
+	for (unsigned i = 0; i < *count; i++) {
+		if (result == ERROR_OK && remote_bitbang_get(pending[i].buffer,
+					DIV_ROUND_UP(pending[i].size, 8)) != ERROR_OK)
+			result = ERROR_FAIL;
+		if (result == ERROR_OK &&
+				jtag_read_buffer(pending[i].buffer, pending[i].command) != ERROR_OK)
+			*retval = ERROR_JTAG_QUEUE_FAILED;
+		free(pending[i].buffer);
+	}
+	*count = 0;
+	return result;
+}
+
+/* Run the queue with the packed commands. Scans that capture TDO don't wait
+ * for their reply. The replies are read in order when the queue is done, or
+ * sooner when too many of them are outstanding. */
+static int remote_bitbang_packed_execute_queue(void)
+{
+	int retval = ERROR_OK;
+	unsigned pending_count = 0, pending_max = 0;
+	size_t pending_bytes = 0;
+	struct remote_bitbang_pending *pending = NULL;
+
+	for (struct jtag_command *cmd = jtag_command_queue; cmd; cmd = cmd->next) {
+		int result = ERROR_OK;
+		switch (cmd->type) {
+			case JTAG_RESET:
+				if ((cmd->cmd.reset->trst == 1) ||
+						(cmd->cmd.reset->srst && (jtag_get_reset_config() & RESET_SRST_PULLS_TRST)))
+					tap_set_state(TAP_RESET);
+				result = remote_bitbang_reset(cmd->cmd.reset->trst,
+						cmd->cmd.reset->srst);
+				break;
+			case JTAG_RUNTEST:
+				result = remote_bitbang_packed_runtest(cmd->cmd.runtest->num_cycles,
+						cmd->cmd.runtest->end_state);
+				break;
+			case JTAG_STABLECLOCKS:
+				result = remote_bitbang_packed_clocks(tap_get_state() == TAP_RESET,
+						cmd->cmd.stableclocks->num_cycles);
+				break;
+			case JTAG_TLR_RESET:
+				tap_set_end_state(cmd->cmd.statemove->end_state);
+				result = remote_bitbang_packed_state_move(0);
+				break;
+			case JTAG_PATHMOVE:
+				result = remote_bitbang_packed_path_move(cmd->cmd.pathmove);
+				break;
+			case JTAG_TMS:
+				result = remote_bitbang_packed_tms(cmd->cmd.tms->bits, 0,
+						cmd->cmd.tms->num_bits);
+				break;
+			case JTAG_SLEEP:
+				result = remote_bitbang_collect(pending, &pending_count, &retval);
+				pending_bytes = 0;
+				jtag_sleep(cmd->cmd.sleep->us);
+				break;
+			case JTAG_SCAN: {
+				uint8_t *buffer;
+				int scan_size = jtag_build_buffer(cmd->cmd.scan, &buffer);
+				result = remote_bitbang_packed_scan(cmd->cmd.scan, buffer, scan_size);
+				if (result != ERROR_OK || jtag_scan_type(cmd->cmd.scan) == SCAN_OUT) {
+					free(buffer);
+					break;
+				}
+				if (pending_count == pending_max) {
+					pending_max = pending_max ? 2 * pending_max : 16;
+					struct remote_bitbang_pending *p = realloc(pending,
+							pending_max * sizeof(*pending));
+					if (!p) {
+						free(buffer);
+						result = ERROR_FAIL;
+						break;
+					}
+					pending = p;
+				}
+				pending[pending_count].command = cmd->cmd.scan;
+				pending[pending_count].buffer = buffer;
+				pending[pending_count].size = scan_size;
+				pending_count++;
+				pending_bytes += DIV_ROUND_UP(scan_size, 8);
+				if (pending_bytes >= REMOTE_BITBANG_MAX_PENDING) {
+					result = remote_bitbang_collect(pending, &pending_count, &retval);
+					pending_bytes = 0;
+				}
+				break;
+			}
+			default:
+				LOG_ERROR("BUG: unknown JTAG command type encountered");
+				exit(-1);
+		}
+		if (result != ERROR_OK) {
+			retval = ERROR_FAIL;
+			break;
+		}
+	}
+
+	if (retval != ERROR_FAIL) {
+		if (remote_bitbang_collect(pending, &pending_count, &retval) != ERROR_OK ||
+				remote_bitbang_flush() != ERROR_OK)
+			retval = ERROR_FAIL;
+	}
+	for (unsigned i = 0; i < pending_count; i++)
+		free(pending[i].buffer);
+	free(pending);
+	return retval;
+}
+
+static int remote_bitbang_execute_queue(void)
+{
+	if (!remote_bitbang_packed)
+		return bitbang_execute_queue();
+	return remote_bitbang_packed_execute_queue();
+}
+
+/*
+ * Ask the server whether it understands the packed commands. 'X' is followed
+ * by a read, so a server that only knows the ASCII commands ignores the 'X'
+ * and answers the read with '0' or '1'. A server that does know them answers
+ * 'X' first.
+ */
+static int remote_bitbang_negotiate(void)
+{
+	remote_bitbang_packed = false;
+	if (!remote_bitbang_use_packed)
+		return ERROR_OK;
+
+	if (remote_bitbang_put("XR", 2) != ERROR_OK ||
+			remote_bitbang_flush() != ERROR_OK)
+		return ERROR_FAIL;
+	uint8_t reply;
+	if (remote_bitbang_get(&reply, 1) != ERROR_OK)
+		return ERROR_FAIL;
+	if (reply == 'X') {
+		remote_bitbang_packed = true;
+		if (remote_bitbang_get(&reply, 1) != ERROR_OK)
+			return ERROR_FAIL;
+	}
+	if (reply != '0' && reply != '1') {
+		LOG_ERROR("remote_bitbang: invalid read response: %c(%i)", reply, reply);
+		return ERROR_FAIL;
+	}
+	LOG_INFO("remote_bitbang server %s packed commands",
+			remote_bitbang_packed ? "supports" : "doesn't support");
+	return ERROR_OK;
+}
+
 static int remote_bitbang_init_tcp(void)
 {
 	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
@@ -296,6 +665,11 @@ static int remote_bitbang_init(void)
 		return ERROR_FAIL;
 	}
 
+	if (remote_bitbang_negotiate() != ERROR_OK) {
+		remote_bitbang_quit();
+		return ERROR_FAIL;
+	}
+
 	LOG_INFO("remote_bitbang driver initialized");
 	return ERROR_OK;
 }
@@ -322,6 +696,15 @@ COMMAND_HANDLER(remote_bitbang_handle_remote_bitbang_host_command)
 	return ERROR_COMMAND_SYNTAX_ERROR;
 }
 
+COMMAND_HANDLER(remote_bitbang_handle_remote_bitbang_packed_command)
+{
+	if (CMD_ARGC == 1) {
+		COMMAND_PARSE_ON_OFF(CMD_ARGV[0], remote_bitbang_use_packed);
+		return ERROR_OK;
+	}
+	return ERROR_COMMAND_SYNTAX_ERROR;
+}
+
 static const struct command_registration remote_bitbang_command_handlers[] = {
 	{
 		.name = "remote_bitbang_port",
@@ -339,12 +722,19 @@ static const struct command_registration remote_bitbang_command_handlers[] = {
 			"  if port is 0 or unset, this is the name of the unix socket to use.",
 		.usage = "host_name",
 	},
+	{
+		.name = "remote_bitbang_packed",
+		.handler = remote_bitbang_handle_remote_bitbang_packed_command,
+		.mode = COMMAND_CONFIG,
+		.help = "Set whether to ask the remote jtag for packed scan commands.",
+		.usage = "on|off",
+	},
 	COMMAND_REGISTRATION_DONE,
 };
 
 struct jtag_interface remote_bitbang_interface = {
 	.name = "remote_bitbang",
-	.execute_queue = &bitbang_execute_queue,
+	.execute_queue = &remote_bitbang_execute_queue,
 	.commands = remote_bitbang_command_handlers,
 	.init = &remote_bitbang_init,
 	.quit = &remote_bitbang_quit,
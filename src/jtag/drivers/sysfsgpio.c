@@ -44,6 +44,11 @@
  * For speed the sysfs "value" entry is opened at init and held open.
  * This results in considerable gains over open-write-close (45s vs 900s)
  *
+ * Alternatively the lines can be requested from a GPIO character device
+ * (/dev/gpiochipN, see sysfsgpio_gpiochip), in which case the gpio numbers
+ * are line offsets on that chip. TCK, TMS and TDI are then requested together,
+ * so every edge takes a single ioctl instead of up to three writes.
+ *
  * Further work could address:
  *  -srst and trst open drain/ push pull
  *  -configurable active high/low for srst & trst
@@ -52,6 +57,11 @@
 #include "config.h"
 #endif
 
+#ifdef HAVE_LINUX_GPIO_H
+#include <linux/gpio.h>
+#include <sys/ioctl.h>
+#endif
+
 #include <jtag/interface.h>
 #include "bitbang.h"
 
@@ -151,6 +161,102 @@ static int setup_sysfs_gpio(int gpio, int is_output, int init_high)
 	return ret;
 }
 
+/*
+ * GPIO character device to use instead of sysfs, or -1. Set up during init
+ * when it isn't -1. The file descriptors below are then line handles.
+ */
+static int gpiochip = -1;
+static int gpiochip_fd = -1;
+
+/* Line handle for tck, tms and tdi together, in that order. */
+static int jtag_out_fd = -1;
+
+#ifdef HAVE_LINUX_GPIO_H
+/*
+ * Request lines of the GPIO chip, as outputs with the given initial values or
+ * as inputs.
+ *
+ * Returns the line handle, or negative on failure.
+ */
+static int gpiochip_request(const int *lines, const uint8_t *values,
+		unsigned count, bool is_output)
+{
+	struct gpiohandle_request request;
+	memset(&request, 0, sizeof(request));
+	for (unsigned i = 0; i < count; i++) {
+		request.lineoffsets[i] = lines[i];
+		if (is_output)
+			request.default_values[i] = values[i];
+	}
+	request.lines = count;
+	request.flags = is_output ? GPIOHANDLE_REQUEST_OUTPUT : GPIOHANDLE_REQUEST_INPUT;
+	strncpy(request.consumer_label, "openocd", sizeof(request.consumer_label) - 1);
+
+	if (ioctl(gpiochip_fd, GPIO_GET_LINEHANDLE_IOCTL, &request) < 0) {
+		LOG_ERROR("Couldn't request line %d of gpiochip%d: %s", lines[0],
+				gpiochip, strerror(errno));
+		return -1;
+	}
+	return request.fd;
+}
+
+static int gpiochip_request_one(int line, bool is_output, int init_high)
+{
+	uint8_t value = init_high;
+	return gpiochip_request(&line, &value, 1, is_output);
+}
+#endif
+
+/*
+ * Helper func to set the lines of a line handle, or a sysfs value file.
+ */
+static void gpio_write_values(int fd, const uint8_t *values, unsigned count,
+		const char *name)
+{
+#ifdef HAVE_LINUX_GPIO_H
+	if (gpiochip >= 0) {
+		struct gpiohandle_data data;
+		memset(&data, 0, sizeof(data));
+		memcpy(data.values, values, count);
+		if (ioctl(fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data) < 0)
+			LOG_WARNING("writing %s failed", name);
+		return;
+	}
+#endif
+	if (write(fd, values[0] ? "1" : "0", 1) != 1)
+		LOG_WARNING("writing %s failed", name);
+}
+
+static void gpio_write_value(int fd, int value, const char *name)
+{
+	uint8_t v = value;
+	gpio_write_values(fd, &v, 1, name);
+}
+
+/*
+ * Helper func to read a single line handle, or a sysfs value file.
+ *
+ * Returns 0 or 1, or negative on failure.
+ */
+static int gpio_read_value(int fd)
+{
+#ifdef HAVE_LINUX_GPIO_H
+	if (gpiochip >= 0) {
+		struct gpiohandle_data data;
+		if (ioctl(fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data) < 0)
+			return -1;
+		return !!data.values[0];
+	}
+#endif
+	char buf[1];
+
+	/* important to seek to signal sysfs of new read */
+	lseek(fd, 0, SEEK_SET);
+	if (read(fd, &buf, sizeof(buf)) < 0)
+		return -1;
+	return buf[0] != '0';
+}
+
 /* gpio numbers for each gpio. Negative values are invalid */
 static int tck_gpio = -1;
 static int tms_gpio = -1;
@@ -184,6 +290,17 @@ static void sysfsgpio_swdio_drive(bool is_output)
 	char buf[40];
 	int ret;
 
+#ifdef HAVE_LINUX_GPIO_H
+	if (gpiochip >= 0) {
+		/* The direction of a line handle is fixed, so request it again. */
+		close(swdio_fd);
+		swdio_fd = gpiochip_request_one(swdio_gpio, is_output, 1);
+		last_stored = false;
+		swdio_input = !is_output;
+		return;
+	}
+#endif
+
 	snprintf(buf, sizeof(buf), "/sys/class/gpio/gpio%d/direction", swdio_gpio);
 	ret = open_write_close(buf, is_output ? "high" : "in");
 	if (ret < 0) {
@@ -197,41 +314,26 @@ static void sysfsgpio_swdio_drive(bool is_output)
 
 static int sysfsgpio_swdio_read(void)
 {
-	char buf[1];
-
-	/* important to seek to signal sysfs of new read */
-	lseek(swdio_fd, 0, SEEK_SET);
-	int ret = read(swdio_fd, &buf, sizeof(buf));
+	int ret = gpio_read_value(swdio_fd);
 
 	if (ret < 0) {
 		LOG_WARNING("reading swdio failed");
 		return 0;
 	}
 
-	return buf[0] != '0';
+	return ret;
 }
 
 static void sysfsgpio_swdio_write(int swclk, int swdio)
 {
-	const char one[] = "1";
-	const char zero[] = "0";
-
-	size_t bytes_written;
-
 	if (!swdio_input) {
-		if (!last_stored || (swdio != last_swdio)) {
-			bytes_written = write(swdio_fd, swdio ? &one : &zero, 1);
-			if (bytes_written != 1)
-				LOG_WARNING("writing swdio failed");
-		}
+		if (!last_stored || (swdio != last_swdio))
+			gpio_write_value(swdio_fd, swdio, "swdio");
 	}
 
 	/* write swclk last */
-	if (!last_stored || (swclk != last_swclk)) {
-		bytes_written = write(swclk_fd, swclk ? &one : &zero, 1);
-		if (bytes_written != 1)
-			LOG_WARNING("writing swclk failed");
-	}
+	if (!last_stored || (swclk != last_swclk))
+		gpio_write_value(swclk_fd, swclk, "swclk");
 
 	last_swdio = swdio;
 	last_swclk = swclk;
@@ -246,18 +348,14 @@ static void sysfsgpio_swdio_write(int swclk, int swdio)
  */
 static bb_value_t sysfsgpio_read(void)
 {
-	char buf[1];
-
-	/* important to seek to signal sysfs of new read */
-	lseek(tdo_fd, 0, SEEK_SET);
-	int ret = read(tdo_fd, &buf, sizeof(buf));
+	int ret = gpio_read_value(tdo_fd);
 
 	if (ret < 0) {
 		LOG_WARNING("reading tdo failed");
 		return 0;
 	}
 
-	return buf[0] == '0' ? BB_LOW : BB_HIGH;
+	return ret ? BB_HIGH : BB_LOW;
 }
 
 /*
@@ -273,15 +371,11 @@ static int sysfsgpio_write(int tck, int tms, int tdi)
 		return ERROR_OK;
 	}
 
-	const char one[] = "1";
-	const char zero[] = "0";
-
 	static int last_tck;
 	static int last_tms;
 	static int last_tdi;
 
 	static int first_time;
-	size_t bytes_written;
 
 	if (!first_time) {
 		last_tck = !tck;
@@ -290,23 +384,22 @@ static int sysfsgpio_write(int tck, int tms, int tdi)
 		first_time = 1;
 	}
 
-	if (tdi != last_tdi) {
-		bytes_written = write(tdi_fd, tdi ? &one : &zero, 1);
-		if (bytes_written != 1)
-			LOG_WARNING("writing tdi failed");
-	}
+	if (jtag_out_fd >= 0) {
+		/* All three lines change in a single request. */
+		if (tck != last_tck || tms != last_tms || tdi != last_tdi) {
+			uint8_t values[3] = { tck, tms, tdi };
+			gpio_write_values(jtag_out_fd, values, 3, "tck/tms/tdi");
+		}
+	} else {
+		if (tdi != last_tdi)
+			gpio_write_value(tdi_fd, tdi, "tdi");
 
-	if (tms != last_tms) {
-		bytes_written = write(tms_fd, tms ? &one : &zero, 1);
-		if (bytes_written != 1)
-			LOG_WARNING("writing tms failed");
-	}
+		if (tms != last_tms)
+			gpio_write_value(tms_fd, tms, "tms");
 
-	/* write clk last */
-	if (tck != last_tck) {
-		bytes_written = write(tck_fd, tck ? &one : &zero, 1);
-		if (bytes_written != 1)
-			LOG_WARNING("writing tck failed");
+		/* write clk last */
+		if (tck != last_tck)
+			gpio_write_value(tck_fd, tck, "tck");
 	}
 
 	last_tdi = tdi;
@@ -316,6 +409,30 @@ static int sysfsgpio_write(int tck, int tms, int tdi)
 	return ERROR_OK;
 }
 
+/*
+ * Bitbang interface write of a whole scan
+ *
+ * Calls the single bit functions directly, without going through the
+ * function pointers for every edge.
+ */
+static int sysfsgpio_write_bits(const uint8_t *tms, const uint8_t *tdi,
+		uint8_t *tdo, unsigned num_bits)
+{
+	for (unsigned i = 0; i < num_bits; i++) {
+		int tms_bit = (tms[i / 8] >> (i % 8)) & 1;
+		int tdi_bit = (tdi[i / 8] >> (i % 8)) & 1;
+		sysfsgpio_write(0, tms_bit, tdi_bit);
+		if (tdo) {
+			if (sysfsgpio_read() == BB_HIGH)
+				tdo[i / 8] |= 1 << (i % 8);
+			else
+				tdo[i / 8] &= ~(1 << (i % 8));
+		}
+		sysfsgpio_write(1, tms_bit, tdi_bit);
+	}
+	return ERROR_OK;
+}
+
 /*
  * Bitbang interface to manipulate reset lines SRST and TRST
  *
@@ -324,23 +441,14 @@ static int sysfsgpio_write(int tck, int tms, int tdi)
 static int sysfsgpio_reset(int trst, int srst)
 {
 	LOG_DEBUG("sysfsgpio_reset");
-	const char one[] = "1";
-	const char zero[] = "0";
-	size_t bytes_written;
 
 	/* assume active low */
-	if (srst_fd >= 0) {
-		bytes_written = write(srst_fd, srst ? &zero : &one, 1);
-		if (bytes_written != 1)
-			LOG_WARNING("writing srst failed");
-	}
+	if (srst_fd >= 0)
+		gpio_write_value(srst_fd, !srst, "srst");
 
 	/* assume active low */
-	if (trst_fd >= 0) {
-		bytes_written = write(trst_fd, trst ? &zero : &one, 1);
-		if (bytes_written != 1)
-			LOG_WARNING("writing trst failed");
-	}
+	if (trst_fd >= 0)
+		gpio_write_value(trst_fd, !trst, "trst");
 
 	return ERROR_OK;
 }
@@ -417,6 +525,26 @@ COMMAND_HANDLER(sysfsgpio_handle_jtag_gpionum_trst)
 	return ERROR_OK;
 }
 
+COMMAND_HANDLER(sysfsgpio_handle_gpiochip)
+{
+	if (CMD_ARGC == 1) {
+		COMMAND_PARSE_NUMBER(int, CMD_ARGV[0], gpiochip);
+#ifndef HAVE_LINUX_GPIO_H
+		if (gpiochip >= 0) {
+			gpiochip = -1;
+			LOG_ERROR("GPIO character device support wasn't built in");
+			return ERROR_FAIL;
+		}
+#endif
+	}
+
+	if (gpiochip >= 0)
+		command_print(CMD_CTX, "SysfsGPIO gpiochip: %d", gpiochip);
+	else
+		command_print(CMD_CTX, "SysfsGPIO gpiochip: none, using sysfs");
+	return ERROR_OK;
+}
+
 COMMAND_HANDLER(sysfsgpio_handle_swd_gpionums)
 {
 	if (CMD_ARGC == 2) {
@@ -501,6 +629,15 @@ static const struct command_registration sysfsgpio_command_handlers[] = {
 		.help = "gpio number for trst.",
 		.usage = "[trst]",
 	},
+	{
+		.name = "sysfsgpio_gpiochip",
+		.handler = &sysfsgpio_handle_gpiochip,
+		.mode = COMMAND_CONFIG,
+		.help = "number of the /dev/gpiochip character device to use instead "
+			"of sysfs, or -1 for sysfs. The gpio numbers are then line offsets "
+			"on that chip.",
+		.usage = "[chip]",
+	},
 	{
 		.name = "sysfsgpio_swd_nums",
 		.handler = &sysfsgpio_handle_swd_gpionums,
@@ -544,6 +681,7 @@ struct jtag_interface sysfsgpio_interface = {
 static struct bitbang_interface sysfsgpio_bitbang = {
 	.read = sysfsgpio_read,
 	.write = sysfsgpio_write,
+	.write_bits = sysfsgpio_write_bits,
 	.reset = sysfsgpio_reset,
 	.swdio_read = sysfsgpio_swdio_read,
 	.swdio_drive = sysfsgpio_swdio_drive,
@@ -557,12 +695,22 @@ static void cleanup_fd(int fd, int gpio)
 		if (fd >= 0)
 			close(fd);
 
-		unexport_sysfs_gpio(gpio);
+		if (gpiochip < 0)
+			unexport_sysfs_gpio(gpio);
 	}
 }
 
 static void cleanup_all_fds(void)
 {
+	if (jtag_out_fd >= 0) {
+		close(jtag_out_fd);
+		jtag_out_fd = -1;
+	}
+	if (gpiochip_fd >= 0) {
+		/* Line handles stay valid without the chip. */
+		close(gpiochip_fd);
+		gpiochip_fd = -1;
+	}
 	cleanup_fd(tck_fd, tck_gpio);
 	cleanup_fd(tms_fd, tms_gpio);
 	cleanup_fd(tdi_fd, tdi_gpio);
@@ -595,25 +743,8 @@ static bool sysfsgpio_swd_mode_possible(void)
 	return 1;
 }
 
-static int sysfsgpio_init(void)
+static int sysfsgpio_init_sysfs(void)
 {
-	bitbang_interface = &sysfsgpio_bitbang;
-
-	LOG_INFO("SysfsGPIO JTAG/SWD bitbang driver");
-
-	if (sysfsgpio_jtag_mode_possible()) {
-		if (sysfsgpio_swd_mode_possible())
-			LOG_INFO("JTAG and SWD modes enabled");
-		else
-			LOG_INFO("JTAG only mode enabled (specify swclk and swdio gpio to add SWD mode)");
-	} else if (sysfsgpio_swd_mode_possible()) {
-		LOG_INFO("SWD only mode enabled (specify tck, tms, tdi and tdo gpios to add JTAG mode)");
-	} else {
-		LOG_ERROR("Require tck, tms, tdi and tdo gpios for JTAG mode and/or swclk and swdio gpio for SWD mode");
-		return ERROR_JTAG_INIT_FAILED;
-	}
-
-
 	/*
 	 * Configure TDO as an input, and TDI, TCK, TMS, TRST, SRST
 	 * as outputs.  Drive TDI and TCK low, and TMS/TRST/SRST high.
@@ -622,53 +753,142 @@ static int sysfsgpio_init(void)
 	if (tck_gpio >= 0) {
 		tck_fd = setup_sysfs_gpio(tck_gpio, 1, 0);
 		if (tck_fd < 0)
-			goto out_error;
+			return ERROR_FAIL;
 	}
 
 	if (tms_gpio >= 0) {
 		tms_fd = setup_sysfs_gpio(tms_gpio, 1, 1);
 		if (tms_fd < 0)
-			goto out_error;
+			return ERROR_FAIL;
 	}
 
 	if (tdi_gpio >= 0) {
 		tdi_fd = setup_sysfs_gpio(tdi_gpio, 1, 0);
 		if (tdi_fd < 0)
-			goto out_error;
+			return ERROR_FAIL;
 	}
 
 	if (tdo_gpio >= 0) {
 		tdo_fd = setup_sysfs_gpio(tdo_gpio, 0, 0);
 		if (tdo_fd < 0)
-			goto out_error;
+			return ERROR_FAIL;
 	}
 
 	/* assume active low*/
 	if (trst_gpio >= 0) {
 		trst_fd = setup_sysfs_gpio(trst_gpio, 1, 1);
 		if (trst_fd < 0)
-			goto out_error;
+			return ERROR_FAIL;
 	}
 
 	/* assume active low*/
 	if (srst_gpio >= 0) {
 		srst_fd = setup_sysfs_gpio(srst_gpio, 1, 1);
 		if (srst_fd < 0)
-			goto out_error;
+			return ERROR_FAIL;
 	}
 
 	if (swclk_gpio >= 0) {
 		swclk_fd = setup_sysfs_gpio(swclk_gpio, 1, 0);
 		if (swclk_fd < 0)
-			goto out_error;
+			return ERROR_FAIL;
 	}
 
 	if (swdio_gpio >= 0) {
 		swdio_fd = setup_sysfs_gpio(swdio_gpio, 1, 0);
 		if (swdio_fd < 0)
-			goto out_error;
+			return ERROR_FAIL;
+	}
+
+	return ERROR_OK;
+}
+
+#ifdef HAVE_LINUX_GPIO_H
+/*
+ * Request the lines from the GPIO character device, with the same directions
+ * and initial levels as the sysfs setup.
+ */
+static int sysfsgpio_init_gpiochip(void)
+{
+	char buf[40];
+	snprintf(buf, sizeof(buf), "/dev/gpiochip%d", gpiochip);
+	gpiochip_fd = open(buf, O_RDWR);
+	if (gpiochip_fd < 0) {
+		LOG_ERROR("Couldn't open %s: %s", buf, strerror(errno));
+		return ERROR_FAIL;
+	}
+
+	if (sysfsgpio_jtag_mode_possible()) {
+		const int lines[3] = { tck_gpio, tms_gpio, tdi_gpio };
+		const uint8_t values[3] = { 0, 1, 0 };
+		jtag_out_fd = gpiochip_request(lines, values, 3, true);
+		if (jtag_out_fd < 0)
+			return ERROR_FAIL;
+
+		tdo_fd = gpiochip_request_one(tdo_gpio, false, 0);
+		if (tdo_fd < 0)
+			return ERROR_FAIL;
+	}
+
+	/* assume active low*/
+	if (trst_gpio >= 0) {
+		trst_fd = gpiochip_request_one(trst_gpio, true, 1);
+		if (trst_fd < 0)
+			return ERROR_FAIL;
+	}
+
+	/* assume active low*/
+	if (srst_gpio >= 0) {
+		srst_fd = gpiochip_request_one(srst_gpio, true, 1);
+		if (srst_fd < 0)
+			return ERROR_FAIL;
+	}
+
+	if (swclk_gpio >= 0) {
+		swclk_fd = gpiochip_request_one(swclk_gpio, true, 0);
+		if (swclk_fd < 0)
+			return ERROR_FAIL;
+	}
+
+	if (swdio_gpio >= 0) {
+		swdio_fd = gpiochip_request_one(swdio_gpio, true, 0);
+		if (swdio_fd < 0)
+			return ERROR_FAIL;
 	}
 
+	LOG_INFO("Using gpiochip%d", gpiochip);
+	return ERROR_OK;
+}
+#endif
+
+static int sysfsgpio_init(void)
+{
+	bitbang_interface = &sysfsgpio_bitbang;
+
+	LOG_INFO("SysfsGPIO JTAG/SWD bitbang driver");
+
+	if (sysfsgpio_jtag_mode_possible()) {
+		if (sysfsgpio_swd_mode_possible())
+			LOG_INFO("JTAG and SWD modes enabled");
+		else
+			LOG_INFO("JTAG only mode enabled (specify swclk and swdio gpio to add SWD mode)");
+	} else if (sysfsgpio_swd_mode_possible()) {
+		LOG_INFO("SWD only mode enabled (specify tck, tms, tdi and tdo gpios to add JTAG mode)");
+	} else {
+		LOG_ERROR("Require tck, tms, tdi and tdo gpios for JTAG mode and/or swclk and swdio gpio for SWD mode");
+		return ERROR_JTAG_INIT_FAILED;
+	}
+
+
+#ifdef HAVE_LINUX_GPIO_H
+	if (gpiochip >= 0) {
+		if (sysfsgpio_init_gpiochip() != ERROR_OK)
+			goto out_error;
+	} else
+#endif
+	if (sysfsgpio_init_sysfs() != ERROR_OK)
+		goto out_error;
+
 	if (sysfsgpio_swd_mode_possible()) {
 		if (swd_mode)
 			bitbang_swd_switch_seq(JTAG_TO_SWD);
@@ -364,6 +364,12 @@ void jtag_add_plain_ir_scan(int num_bits, const uint8_t *out_bits, uint8_t *in_b
  */
 void jtag_add_dr_scan(struct jtag_tap *tap, int num_fields,
 		const struct scan_field *fields, tap_state_t endstate);
+/**
+ * Register a buffer of out values that stay valid and unchanged until the
+ * JTAG queue has been executed. Scans whose out_value lies in the buffer
+ * are queued without copying it.
+ */
+void jtag_add_out_buffer(const uint8_t *buffer, size_t size);
 /** A version of jtag_add_dr_scan() that uses the check_value/mask fields */
 void jtag_add_dr_scan_check(struct jtag_tap *tap, int num_fields,
 		struct scan_field *fields, tap_state_t endstate);
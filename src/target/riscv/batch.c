@@ -11,35 +11,112 @@
 
 static void dump_field(int idle, const struct scan_field *field);
 
-struct riscv_batch *riscv_batch_alloc(struct target *target, size_t scans, size_t idle)
+/* Make room for at least scans scans. All the per-scan arrays live in a
+ * single allocation: the fields first, so they stay aligned, followed by the
+ * read keys and the data going out and coming in. */
+static int riscv_batch_reserve(struct riscv_batch *batch, size_t scans)
+{
+	if (scans <= batch->capacity)
+		return ERROR_OK;
+
+	size_t bytes = scans * (sizeof(*batch->fields) +
+			sizeof(*batch->read_keys) + 2 * sizeof(uint64_t));
+	uint8_t *buffer = realloc(batch->buffer, bytes);
+	if (!buffer) {
+		LOG_ERROR("Failed to allocate %zu bytes for a batch of %zu scans.",
+				bytes, scans);
+		return ERROR_FAIL;
+	}
+	batch->buffer = buffer;
+	batch->capacity = scans;
+
+	batch->fields = (struct scan_field *)buffer;
+	buffer += scans * sizeof(*batch->fields);
+	batch->read_keys = (size_t *)buffer;
+	buffer += scans * sizeof(*batch->read_keys);
+	batch->data_out = buffer;
+	buffer += scans * sizeof(uint64_t);
+	batch->data_in = buffer;
+	return ERROR_OK;
+}
+
+int riscv_batch_reset(struct riscv_batch *batch, size_t scans, size_t idle)
 {
 	scans += 4;
-	struct riscv_batch *out = calloc(1, sizeof(*out));
-	out->target = target;
-	out->allocated_scans = scans;
-	out->idle_count = idle;
-	out->data_out = malloc(sizeof(*out->data_out) * (scans) * sizeof(uint64_t));
-	out->data_in  = malloc(sizeof(*out->data_in)  * (scans) * sizeof(uint64_t));
-	out->fields = malloc(sizeof(*out->fields) * (scans));
-	out->last_scan = RISCV_SCAN_TYPE_INVALID;
-	out->read_keys = malloc(sizeof(*out->read_keys) * (scans));
+	if (riscv_batch_reserve(batch, scans) != ERROR_OK)
+		return ERROR_FAIL;
+	batch->allocated_scans = scans;
+	batch->used_scans = 0;
+	batch->idle_count = idle;
+	batch->last_scan = RISCV_SCAN_TYPE_INVALID;
+	batch->read_keys_used = 0;
+	return ERROR_OK;
+}
+
+struct riscv_batch *riscv_batch_alloc(struct target *target, size_t scans, size_t idle)
+{
+	riscv_info_t *r = riscv_info(target);
+	struct riscv_batch *out = r->batch_pool;
+	if (out) {
+		r->batch_pool = NULL;
+	} else {
+		out = calloc(1, sizeof(*out));
+		if (!out) {
+			LOG_ERROR("Failed to allocate a batch.");
+			return NULL;
+		}
+		out->target = target;
+	}
+
+	if (riscv_batch_reset(out, scans, idle) != ERROR_OK) {
+		riscv_batch_free(out);
+		return NULL;
+	}
 	return out;
 }
 
-void riscv_batch_free(struct riscv_batch *batch)
+static void riscv_batch_destroy(struct riscv_batch *batch)
 {
-	free(batch->data_in);
-	free(batch->data_out);
-	free(batch->fields);
-	free(batch->read_keys);
+	free(batch->buffer);
 	free(batch);
 }
 
+void riscv_batch_free(struct riscv_batch *batch)
+{
+	if (!batch)
+		return;
+
+	/* Keep the larger of the two batches around for next time. */
+	riscv_info_t *r = riscv_info(batch->target);
+	if (r->batch_pool && r->batch_pool->capacity >= batch->capacity) {
+		riscv_batch_destroy(batch);
+		return;
+	}
+	if (r->batch_pool)
+		riscv_batch_destroy(r->batch_pool);
+	r->batch_pool = batch;
+}
+
+void riscv_batch_free_pool(struct target *target)
+{
+	riscv_info_t *r = riscv_info(target);
+	if (r->batch_pool)
+		riscv_batch_destroy(r->batch_pool);
+	r->batch_pool = NULL;
+}
+
 bool riscv_batch_full(struct riscv_batch *batch)
 {
 	return batch->used_scans > (batch->allocated_scans - 4);
 }
 
+size_t riscv_batch_available_scans(struct riscv_batch *batch)
+{
+	if (batch->used_scans + 4 >= batch->allocated_scans)
+		return 0;
+	return batch->allocated_scans - batch->used_scans - 4;
+}
+
 int riscv_batch_run(struct riscv_batch *batch)
 {
 	if (batch->used_scans == 0) {
@@ -49,23 +126,52 @@ int riscv_batch_run(struct riscv_batch *batch)
 
 	keep_alive();
 
+	riscv_batch_queue(batch);
+
+	riscv_info_t *r = riscv_info(batch->target);
+	int64_t start = riscv_stats_time_us();
+
+	if (jtag_execute_queue() != ERROR_OK) {
+		LOG_ERROR("Unable to execute JTAG queue");
+		return ERROR_FAIL;
+	}
+
+	riscv_stats_add_latency(r->stats.batch_latency, start);
+	riscv_batch_finish(batch);
+
+	return ERROR_OK;
+}
+
+void riscv_batch_queue(struct riscv_batch *batch)
+{
 	riscv_batch_add_nop(batch);
 
+	/* The batch isn't touched until riscv_batch_finish(), so the scans can
+	 * go out straight from data_out. */
+	jtag_add_out_buffer(batch->data_out, batch->used_scans * sizeof(uint64_t));
+
 	for (size_t i = 0; i < batch->used_scans; ++i) {
 		jtag_add_dr_scan(batch->target->tap, 1, batch->fields + i, TAP_IDLE);
 		if (batch->idle_count > 0)
 			jtag_add_runtest(batch->idle_count, TAP_IDLE);
 	}
+}
 
-	if (jtag_execute_queue() != ERROR_OK) {
-		LOG_ERROR("Unable to execute JTAG queue");
-		return ERROR_FAIL;
+void riscv_batch_finish(struct riscv_batch *batch)
+{
+	riscv_info_t *r = riscv_info(batch->target);
+	r->stats.batches++;
+	r->stats.batch_scans += batch->used_scans;
+	/* The first scan shifts out the result of whatever came before the
+	 * batch. */
+	for (size_t i = 1; i < batch->used_scans; ++i) {
+		if (buf_get_u32(batch->fields[i].in_value, DTM_DMI_OP_OFFSET,
+					DTM_DMI_OP_LENGTH) == DMI_STATUS_BUSY)
+			r->stats.batch_busy++;
 	}
 
 	for (size_t i = 0; i < batch->used_scans; ++i)
 		dump_field(batch->idle_count, batch->fields + i);
-
-	return ERROR_OK;
 }
 
 void riscv_batch_add_dmi_write(struct riscv_batch *batch, unsigned address, uint64_t data)
@@ -113,6 +219,16 @@ uint64_t riscv_batch_get_dmi_read(struct riscv_batch *batch, size_t key)
 		((uint64_t) base[7]) << 56;
 }
 
+unsigned riscv_batch_get_dmi_read_op(struct riscv_batch *batch, size_t key)
+{
+	return get_field(riscv_batch_get_dmi_read(batch, key), DTM_DMI_OP);
+}
+
+uint32_t riscv_batch_get_dmi_read_data(struct riscv_batch *batch, size_t key)
+{
+	return get_field(riscv_batch_get_dmi_read(batch, key), DTM_DMI_DATA);
+}
+
 void riscv_batch_add_nop(struct riscv_batch *batch)
 {
 	assert(batch->used_scans < batch->allocated_scans);
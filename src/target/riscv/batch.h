@@ -11,6 +11,13 @@ enum riscv_scan_type {
 	RISCV_SCAN_TYPE_WRITE,
 };
 
+/* Status in the op field of a DMI scan's result. */
+typedef enum {
+	DMI_STATUS_SUCCESS = 0,
+	DMI_STATUS_FAILED = 2,
+	DMI_STATUS_BUSY = 3
+} dmi_status_t;
+
 /* A batch of multiple JTAG scans, which are grouped together to avoid the
  * overhead of some JTAG adapters when sending single commands.  This is
  * designed to support block copies, as that's what we actually need to go
@@ -21,6 +28,12 @@ struct riscv_batch {
 	size_t allocated_scans;
 	size_t used_scans;
 
+	/* Number of scans there is room for in buffer, which holds fields,
+	 * read_keys, data_out and data_in. Can be more than allocated_scans when
+	 * the batch is reused. */
+	size_t capacity;
+	uint8_t *buffer;
+
 	size_t idle_count;
 
 	uint8_t *data_out;
@@ -40,16 +53,35 @@ struct riscv_batch {
 
 /* Allocates (or frees) a new scan set.  "scans" is the maximum number of JTAG
  * scans that can be issued to this object, and idle is the number of JTAG idle
- * cycles between every real scan. */
+ * cycles between every real scan.
+ * Every target keeps the last freed batch around, and the next allocation
+ * reuses its buffers, so a loop that allocates and frees a batch for every
+ * chunk doesn't hit malloc each time. riscv_batch_free_pool() releases it. */
 struct riscv_batch *riscv_batch_alloc(struct target *target, size_t scans, size_t idle);
 void riscv_batch_free(struct riscv_batch *batch);
+void riscv_batch_free_pool(struct target *target);
+
+/* Empties the batch so it can be filled again, like a new allocation with the
+ * given parameters but keeping the buffers when they are large enough. */
+int riscv_batch_reset(struct riscv_batch *batch, size_t scans, size_t idle);
 
 /* Checks to see if this batch is full. */
 bool riscv_batch_full(struct riscv_batch *batch);
 
+/* Returns how many more scans can be added to this batch. */
+size_t riscv_batch_available_scans(struct riscv_batch *batch);
+
 /* Executes this scan batch. */
 int riscv_batch_run(struct riscv_batch *batch);
 
+/* Like riscv_batch_run(), but in two halves, so that batches for several
+ * targets can go out in a single jtag_execute_queue(): riscv_batch_queue()
+ * adds the scans to the JTAG queue, and once it has been executed
+ * riscv_batch_finish() accounts for the results. The caller has to make sure
+ * the DMI is selected in IR first. */
+void riscv_batch_queue(struct riscv_batch *batch);
+void riscv_batch_finish(struct riscv_batch *batch);
+
 /* Adds a DMI write to this batch. */
 void riscv_batch_add_dmi_write(struct riscv_batch *batch, unsigned address, uint64_t data);
 
@@ -58,6 +90,11 @@ void riscv_batch_add_dmi_write(struct riscv_batch *batch, unsigned address, uint
 size_t riscv_batch_add_dmi_read(struct riscv_batch *batch, unsigned address);
 uint64_t riscv_batch_get_dmi_read(struct riscv_batch *batch, size_t key);
 
+/* Convenience accessors for the status (op) and data fields of a read that
+ * was scheduled with riscv_batch_add_dmi_read(). */
+unsigned riscv_batch_get_dmi_read_op(struct riscv_batch *batch, size_t key);
+uint32_t riscv_batch_get_dmi_read_data(struct riscv_batch *batch, size_t key);
+
 /* Scans in a NOP. */
 void riscv_batch_add_nop(struct riscv_batch *batch);
 
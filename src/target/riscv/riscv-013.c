@@ -31,6 +31,9 @@
 #define DMI_DATA1 (DMI_DATA0 + 1)
 #define DMI_PROGBUF1 (DMI_PROGBUF0 + 1)
 
+/* Number of DMI scans to queue per batch when accessing the system bus. */
+#define SB_BATCH_SCANS 256
+
 static int riscv013_on_step_or_resume(struct target *target, bool step);
 static int riscv013_step_or_resume_current_hart(struct target *target,
 		bool step, bool use_hasel);
@@ -44,14 +47,27 @@ static int riscv013_select_current_hart(struct target *target);
 static int riscv013_halt_prep(struct target *target);
 static int riscv013_halt_go(struct target *target);
 static int riscv013_resume_go(struct target *target);
+static int riscv013_smp_go(struct target *target, bool halt);
+static int riscv013_sample_memory(struct target *target, target_addr_t address,
+		uint32_t size, uint32_t count, uint8_t *buffer);
+static int riscv013_sample_pc(struct target *target, uint32_t count,
+		uint64_t *samples, uint32_t *sampled);
+static int riscv013_sample_memory_set(struct target *target,
+		const riscv_sample_config_t *config, uint64_t *values);
+static int riscv013_step_batch(struct target *target, uint32_t count,
+		uint64_t *pcs, uint32_t *stepped, uint32_t *resumed);
 static int riscv013_step_current_hart(struct target *target);
 static int riscv013_on_halt(struct target *target);
 static int riscv013_on_step(struct target *target);
 static int riscv013_resume_prep(struct target *target);
 static bool riscv013_is_halted(struct target *target);
 static enum riscv_halt_reason riscv013_halt_reason(struct target *target);
+static int riscv013_halt_summary(struct target *target, unsigned generation,
+		int hartid, bool *halted);
 static int riscv013_write_debug_buffer(struct target *target, unsigned index,
 		riscv_insn_t d);
+static int riscv013_write_debug_program(struct target *target, unsigned count,
+		const riscv_insn_t *insns);
 static riscv_insn_t riscv013_read_debug_buffer(struct target *target, unsigned
 		index);
 static int riscv013_execute_debug_buffer(struct target *target);
@@ -74,6 +90,7 @@ void write_memory_sba_simple(struct target *target, target_addr_t addr, uint32_t
 void read_memory_sba_simple(struct target *target, target_addr_t addr,
 		uint32_t *rd_buf, uint32_t read_size, uint32_t sbcs);
 static int	riscv013_test_compliance(struct target *target);
+static int batch_run(const struct target *target, struct riscv_batch *batch);
 
 /**
  * Since almost everything can be accomplish by scanning the dbus register, all
@@ -102,11 +119,6 @@ typedef enum {
 	DMI_OP_READ = 1,
 	DMI_OP_WRITE = 2
 } dmi_op_t;
-typedef enum {
-	DMI_STATUS_SUCCESS = 0,
-	DMI_STATUS_FAILED = 2,
-	DMI_STATUS_BUSY = 3
-} dmi_status_t;
 
 typedef enum {
 	RE_OK,
@@ -163,6 +175,12 @@ typedef struct {
 	/* The program buffer stores executable code. 0 is an illegal instruction,
 	 * so we use 0 to mean the cached value is invalid. */
 	uint32_t progbuf_cache[16];
+
+	/* Bit i of halt_summary[i / 32] is set if hart i was halted according to
+	 * the HALTSUM registers, as read during poll halt_summary_generation. */
+	uint32_t halt_summary[(RISCV_MAX_HARTS + 31) / 32];
+	unsigned halt_summary_generation;
+	bool halt_summary_valid;
 } dm013_info_t;
 
 typedef struct {
@@ -457,6 +475,8 @@ static uint32_t dtmcontrol_scan(struct target *target, uint32_t out)
 static void increase_dmi_busy_delay(struct target *target)
 {
 	riscv013_info_t *info = get_info(target);
+	RISCV_INFO(r);
+	r->stats.dmi_busy_delay_increases++;
 	info->dmi_busy_delay += info->dmi_busy_delay / 10 + 1;
 	LOG_DEBUG("dtmcs_idle=%d, dmi_busy_delay=%d, ac_busy_delay=%d",
 			info->dtmcs_idle, info->dmi_busy_delay,
@@ -564,11 +584,14 @@ static dmi_status_t dmi_scan(struct target *target, uint32_t *address_in,
 	if (idle_count)
 		jtag_add_runtest(idle_count, TAP_IDLE);
 
+	int64_t start = riscv_stats_time_us();
 	int retval = jtag_execute_queue();
 	if (retval != ERROR_OK) {
 		LOG_ERROR("dmi_scan failed jtag scan");
 		return DMI_STATUS_FAILED;
 	}
+	riscv_stats_add_latency(r->stats.dmi_scan_latency, start);
+	r->stats.dmi_scans++;
 
 	if (bscan_tunnel_ir_width != 0) {
 		/* need to right-shift "in" by one bit, because of clock skew between BSCAN TAP and DM TAP */
@@ -581,7 +604,10 @@ static dmi_status_t dmi_scan(struct target *target, uint32_t *address_in,
 	if (address_in)
 		*address_in = buf_get_u32(in, DTM_DMI_ADDRESS_OFFSET, info->abits);
 	dump_field(idle_count, &field);
-	return buf_get_u32(in, DTM_DMI_OP_OFFSET, DTM_DMI_OP_LENGTH);
+	dmi_status_t status = buf_get_u32(in, DTM_DMI_OP_OFFSET, DTM_DMI_OP_LENGTH);
+	if (status == DMI_STATUS_BUSY)
+		r->stats.dmi_busy++;
+	return status;
 }
 
 /* If dmi_busy_encountered is non-NULL, this function will use it to tell the
@@ -737,6 +763,8 @@ int dmstatus_read(struct target *target, uint32_t *dmstatus,
 static void increase_ac_busy_delay(struct target *target)
 {
 	riscv013_info_t *info = get_info(target);
+	RISCV_INFO(r);
+	r->stats.ac_busy_delay_increases++;
 	info->ac_busy_delay += info->ac_busy_delay / 10 + 1;
 	LOG_DEBUG("dtmcs_idle=%d, dmi_busy_delay=%d, ac_busy_delay=%d",
 			info->dtmcs_idle, info->dmi_busy_delay,
@@ -1213,6 +1241,90 @@ static unsigned register_size(struct target *target, unsigned number)
 		return riscv_xlen(target);
 }
 
+/**
+ * Read a number of GPRs/FPRs with abstract commands queued in a single batch,
+ * so they only cost one JTAG round trip. read[i] is set for every register
+ * that could be read this way. If anything went wrong, nothing is set and the
+ * caller should read the registers one at a time instead, which takes care of
+ * reporting errors and figuring out what abstract commands are supported.
+ */
+static int riscv013_read_registers(struct target *target, unsigned count,
+		const unsigned *numbers, uint64_t *values, bool *read)
+{
+	RISCV013_INFO(info);
+
+	for (unsigned i = 0; i < count; i++)
+		read[i] = false;
+
+	struct riscv_batch *batch = riscv_batch_alloc(target, 3 * count + 2,
+			info->dmi_busy_delay + info->ac_busy_delay);
+	if (!batch)
+		return ERROR_FAIL;
+
+	size_t keys[count][2];
+	unsigned sizes[count];
+	bool queued[count];
+	for (unsigned i = 0; i < count; i++) {
+		unsigned number = numbers[i];
+		sizes[i] = register_size(target, number);
+		queued[i] = (number <= GDB_REGNO_XPR31 ||
+				(number >= GDB_REGNO_FPR0 && number <= GDB_REGNO_FPR31 &&
+				 info->abstract_read_fpr_supported)) &&
+				(sizes[i] == 32 || sizes[i] == 64);
+		if (!queued[i])
+			continue;
+		riscv_batch_add_dmi_write(batch, DMI_COMMAND,
+				access_register_command(target, number, sizes[i],
+					AC_ACCESS_REGISTER_TRANSFER));
+		keys[i][0] = riscv_batch_add_dmi_read(batch, DMI_DATA0);
+		if (sizes[i] == 64)
+			keys[i][1] = riscv_batch_add_dmi_read(batch, DMI_DATA1);
+	}
+	size_t abstractcs_key = riscv_batch_add_dmi_read(batch, DMI_ABSTRACTCS);
+
+	if (batch_run(target, batch) != ERROR_OK) {
+		riscv_batch_free(batch);
+		return ERROR_FAIL;
+	}
+
+	/* A busy response is sticky, so if the final abstractcs read went through
+	 * then so did everything before it. */
+	unsigned status = riscv_batch_get_dmi_read_op(batch, abstractcs_key);
+	if (status != DMI_STATUS_SUCCESS) {
+		riscv_batch_free(batch);
+		if (status == DMI_STATUS_BUSY)
+			increase_dmi_busy_delay(target);
+		return ERROR_FAIL;
+	}
+
+	uint32_t abstractcs = riscv_batch_get_dmi_read_data(batch, abstractcs_key);
+	info->cmderr = get_field(abstractcs, DMI_ABSTRACTCS_CMDERR);
+	if (info->cmderr != CMDERR_NONE || get_field(abstractcs, DMI_ABSTRACTCS_BUSY)) {
+		riscv_batch_free(batch);
+		LOG_DEBUG("Batched register read failed; abstractcs=0x%x", abstractcs);
+		if (info->cmderr == CMDERR_BUSY)
+			increase_ac_busy_delay(target);
+		if (wait_for_idle(target, &abstractcs) != ERROR_OK)
+			return ERROR_FAIL;
+		dmi_write(target, DMI_ABSTRACTCS, set_field(0, DMI_ABSTRACTCS_CMDERR,
+					info->cmderr));
+		return ERROR_FAIL;
+	}
+
+	for (unsigned i = 0; i < count; i++) {
+		if (!queued[i])
+			continue;
+		values[i] = riscv_batch_get_dmi_read_data(batch, keys[i][0]);
+		if (sizes[i] == 64)
+			values[i] |= (uint64_t) riscv_batch_get_dmi_read_data(batch,
+					keys[i][1]) << 32;
+		read[i] = true;
+	}
+
+	riscv_batch_free(batch);
+	return ERROR_OK;
+}
+
 /**
  * Immediately write the new value to the requested register. This mechanism
  * bypasses any caches.
@@ -1731,6 +1843,25 @@ static int riscv013_hart_count(struct target *target)
 	return dm->hart_count;
 }
 
+static void riscv013_get_delays(struct target *target, struct riscv_delays *delays)
+{
+	RISCV013_INFO(info);
+	delays->dmi_busy = info->dmi_busy_delay;
+	delays->ac_busy = info->ac_busy_delay;
+	delays->bus_master_read = info->bus_master_read_delay;
+	delays->bus_master_write = info->bus_master_write_delay;
+}
+
+static void riscv013_set_delays(struct target *target,
+		const struct riscv_delays *delays)
+{
+	RISCV013_INFO(info);
+	info->dmi_busy_delay = delays->dmi_busy;
+	info->ac_busy_delay = delays->ac_busy;
+	info->bus_master_read_delay = delays->bus_master_read;
+	info->bus_master_write_delay = delays->bus_master_write;
+}
+
 static int init_target(struct command_context *cmd_ctx,
 		struct target *target)
 {
@@ -1751,6 +1882,7 @@ static int init_target(struct command_context *cmd_ctx,
 	generic_info->halt_reason = &riscv013_halt_reason;
 	generic_info->read_debug_buffer = &riscv013_read_debug_buffer;
 	generic_info->write_debug_buffer = &riscv013_write_debug_buffer;
+	generic_info->write_debug_program = &riscv013_write_debug_program;
 	generic_info->execute_debug_buffer = &riscv013_execute_debug_buffer;
 	generic_info->fill_dmi_write_u64 = &riscv013_fill_dmi_write_u64;
 	generic_info->fill_dmi_read_u64 = &riscv013_fill_dmi_read_u64;
@@ -1763,6 +1895,15 @@ static int init_target(struct command_context *cmd_ctx,
 	generic_info->test_sba_config_reg = &riscv013_test_sba_config_reg;
 	generic_info->test_compliance = &riscv013_test_compliance;
 	generic_info->hart_count = &riscv013_hart_count;
+	generic_info->get_delays = &riscv013_get_delays;
+	generic_info->read_registers = &riscv013_read_registers;
+	generic_info->halt_summary = &riscv013_halt_summary;
+	generic_info->smp_go = &riscv013_smp_go;
+	generic_info->sample_memory = &riscv013_sample_memory;
+	generic_info->sample_pc = &riscv013_sample_pc;
+	generic_info->sample_memory_set = &riscv013_sample_memory_set;
+	generic_info->step_batch = &riscv013_step_batch;
+	generic_info->set_delays = &riscv013_set_delays;
 	generic_info->version_specific = calloc(1, sizeof(riscv013_info_t));
 	if (!generic_info->version_specific)
 		return ERROR_FAIL;
@@ -2200,6 +2341,115 @@ static int read_memory_bus_v0(struct target *target, target_addr_t address,
 	return ERROR_OK;
 }
 
+static int batch_run(const struct target *target, struct riscv_batch *batch)
+{
+	RISCV013_INFO(info);
+	RISCV_INFO(r);
+	if (r->reset_delays_wait >= 0) {
+		r->reset_delays_wait -= batch->used_scans;
+		if (r->reset_delays_wait <= 0) {
+			batch->idle_count = 0;
+			info->dmi_busy_delay = 0;
+			info->ac_busy_delay = 0;
+		}
+	}
+	return riscv_batch_run(batch);
+}
+
+/**
+ * Read words first through count-2 out of the sbdata registers while the
+ * system bus is in sbreadondata mode, so that every read of sbdata0 triggers
+ * the next bus access. The reads are queued in batches, so a large number of
+ * them go out in a single JTAG queue flush. sbcs is read at the end of every
+ * batch to notice errors without an extra round trip.
+ *
+ * On return, *busy is set if either the DMI or the system bus reported busy,
+ * in which case the caller must recover and resume from the address the bus
+ * reached. *sbcs holds the value of sbcs read at the end of the last batch.
+ */
+static int read_memory_bus_v1_batch(struct target *target,
+		target_addr_t address, uint32_t size, uint32_t first, uint32_t count,
+		uint8_t *buffer, uint32_t *sbcs, bool *busy)
+{
+	RISCV013_INFO(info);
+	const unsigned sbdata_count = (size + 3) / 4;
+
+	*busy = false;
+	*sbcs = 0;
+
+	uint32_t i = first;
+	while (i < count - 1) {
+		struct riscv_batch *batch = riscv_batch_alloc(target, SB_BATCH_SCANS,
+				info->dmi_busy_delay + info->bus_master_read_delay);
+
+		uint32_t batch_first = i;
+		/* Leave room for the trailing sbcs read. */
+		while (i < count - 1 &&
+				riscv_batch_available_scans(batch) > sbdata_count) {
+			/* sbdata0 must be read last, since reading it triggers the
+			 * next bus access. */
+			for (int j = sbdata_count - 1; j >= 0; j--)
+				riscv_batch_add_dmi_read(batch, DMI_SBDATA0 + j);
+			i++;
+		}
+		size_t sbcs_key = riscv_batch_add_dmi_read(batch, DMI_SBCS);
+
+		if (batch_run(target, batch) != ERROR_OK) {
+			riscv_batch_free(batch);
+			return ERROR_FAIL;
+		}
+
+		size_t key = 0;
+		for (uint32_t w = batch_first; w < i && !*busy; w++) {
+			for (int j = sbdata_count - 1; j >= 0; j--, key++) {
+				unsigned status = riscv_batch_get_dmi_read_op(batch, key);
+				if (status == DMI_STATUS_BUSY) {
+					*busy = true;
+					break;
+				} else if (status != DMI_STATUS_SUCCESS) {
+					LOG_ERROR("Failed to read sbdata%d at 0x%" TARGET_PRIxADDR
+							"; status=%d", j, address + w * size, status);
+					riscv_batch_free(batch);
+					return ERROR_FAIL;
+				}
+				uint32_t value = riscv_batch_get_dmi_read_data(batch, key);
+				write_to_buf(buffer + w * size + j * 4, value, MIN(size, 4));
+				log_memory_access(address + w * size + j * 4, value,
+						MIN(size, 4), true);
+			}
+		}
+
+		if (!*busy) {
+			unsigned status = riscv_batch_get_dmi_read_op(batch, sbcs_key);
+			if (status == DMI_STATUS_BUSY) {
+				*busy = true;
+			} else if (status != DMI_STATUS_SUCCESS) {
+				LOG_ERROR("Failed to read sbcs; status=%d", status);
+				riscv_batch_free(batch);
+				return ERROR_FAIL;
+			} else {
+				*sbcs = riscv_batch_get_dmi_read_data(batch, sbcs_key);
+				if (get_field(*sbcs, DMI_SBCS_SBBUSYERROR))
+					*busy = true;
+			}
+		}
+
+		riscv_batch_free(batch);
+
+		if (*busy) {
+			/* Clears the sticky DMI busy condition, if that's what we saw,
+			 * so the caller can talk to the DM again. */
+			if (get_field(*sbcs, DMI_SBCS_SBBUSYERROR) == 0)
+				increase_dmi_busy_delay(target);
+			return ERROR_OK;
+		}
+		if (get_field(*sbcs, DMI_SBCS_SBERROR))
+			return ERROR_OK;
+	}
+
+	return ERROR_OK;
+}
+
 /**
  * Read the requested memory using the system bus interface.
  */
@@ -2231,13 +2481,15 @@ static int read_memory_bus_v1(struct target *target, target_addr_t address,
 			}
 		}
 
-		for (uint32_t i = (next_address - address) / size; i < count - 1; i++) {
-			if (read_memory_bus_word(target, address + i * size, size,
-					buffer + i * size) != ERROR_OK)
-				return ERROR_FAIL;
-		}
-
 		uint32_t sbcs_read = 0;
+		bool busy = false;
+		if (read_memory_bus_v1_batch(target, address, size,
+					(next_address - address) / size, count, buffer,
+					&sbcs_read, &busy) != ERROR_OK)
+			return ERROR_FAIL;
+		/* The batch only reads sbcs when every DMI scan went through. */
+		bool dmi_busy = busy && !get_field(sbcs_read, DMI_SBCS_SBBUSYERROR);
+
 		if (count > 1) {
 			/* "Writes to sbcs while sbbusy is high result in undefined behavior.
 			 * A debugger must not write to sbcs until it reads sbbusy as 0." */
@@ -2249,7 +2501,7 @@ static int read_memory_bus_v1(struct target *target, target_addr_t address,
 				return ERROR_FAIL;
 		}
 
-		if (!get_field(sbcs_read, DMI_SBCS_SBERROR) &&
+		if (!busy && !get_field(sbcs_read, DMI_SBCS_SBERROR) &&
 				!get_field(sbcs_read, DMI_SBCS_SBBUSYERROR)) {
 			if (read_memory_bus_word(target, address + (count - 1) * size, size,
 						buffer + (count - 1) * size) != ERROR_OK)
@@ -2263,8 +2515,31 @@ static int read_memory_bus_v1(struct target *target, target_addr_t address,
 			/* We read while the target was busy. Slow down and try again. */
 			if (dmi_write(target, DMI_SBCS, DMI_SBCS_SBBUSYERROR) != ERROR_OK)
 				return ERROR_FAIL;
-			next_address = sb_read_address(target);
 			info->bus_master_read_delay += info->bus_master_read_delay / 10 + 1;
+			busy = true;
+		}
+
+		if (busy && !get_field(sbcs_read, DMI_SBCS_SBERROR)) {
+			/* Every sbdata0 read that went through started the next access,
+			 * so the bus is one word past the last value we received, which
+			 * we read again rather than fetch from sbdata0. After a DMI busy,
+			 * the sbdata0 read that got the busy response still ran: it took
+			 * one more word, whose value was lost, and started the access
+			 * after it. So the bus is two words past the last value we
+			 * received. */
+			target_addr_t bus_address = sb_read_address(target);
+			if (bus_address < next_address + size || bus_address > end_address) {
+				LOG_ERROR("System bus is at unexpected address 0x%" TARGET_PRIxADDR
+						" after busy (reading 0x%" TARGET_PRIxADDR "-0x%"
+						TARGET_PRIxADDR ")", bus_address, address, end_address);
+				return ERROR_FAIL;
+			}
+			target_addr_t resume_address = bus_address - size;
+			if (dmi_busy && resume_address >= next_address + size)
+				resume_address -= size;
+			LOG_DEBUG("System bus read was busy; resuming at 0x%" TARGET_PRIxADDR,
+					resume_address);
+			next_address = resume_address;
 			continue;
 		}
 
@@ -2283,19 +2558,28 @@ static int read_memory_bus_v1(struct target *target, target_addr_t address,
 	return ERROR_OK;
 }
 
-static int batch_run(const struct target *target, struct riscv_batch *batch)
+/* Number of data accesses to put in the next batch of a program buffer
+ * memory loop. */
+static unsigned progbuf_batch_size(struct target *target)
 {
-	RISCV013_INFO(info);
 	RISCV_INFO(r);
-	if (r->reset_delays_wait >= 0) {
-		r->reset_delays_wait -= batch->used_scans;
-		if (r->reset_delays_wait <= 0) {
-			batch->idle_count = 0;
-			info->dmi_busy_delay = 0;
-			info->ac_busy_delay = 0;
-		}
-	}
-	return riscv_batch_run(batch);
+	return r->batch_size;
+}
+
+/* Adapt the batch size to how the last batch went. Grow slowly while full
+ * batches get through, and back off quickly when the target can't keep up. */
+static void progbuf_batch_done(struct target *target, bool full, bool busy)
+{
+	RISCV_INFO(r);
+	unsigned size = r->batch_size;
+	if (busy)
+		size /= 2;
+	else if (full)
+		size += size / 8 + 1;
+	size = MIN(MAX(size, r->batch_size_min), r->batch_size_max);
+	if (size != r->batch_size)
+		LOG_DEBUG("batch size %d -> %d", r->batch_size, size);
+	r->batch_size = size;
 }
 
 /**
@@ -2357,7 +2641,8 @@ static int read_memory_progbuf_inner(struct target *target, target_addr_t addres
 		LOG_DEBUG("creating burst to read from 0x%" PRIx64
 				" up to 0x%" PRIx64, read_addr, fin_addr);
 		assert(read_addr >= address && read_addr < fin_addr);
-		struct riscv_batch *batch = riscv_batch_alloc(target, 32,
+		struct riscv_batch *batch = riscv_batch_alloc(target,
+				progbuf_batch_size(target),
 				info->dmi_busy_delay + info->ac_busy_delay);
 
 		size_t reads = 0;
@@ -2369,6 +2654,7 @@ static int read_memory_progbuf_inner(struct target *target, target_addr_t addres
 				break;
 		}
 
+		bool full = riscv_batch_full(batch);
 		batch_run(target, batch);
 
 		/* Wait for the target to finish performing the last abstract command,
@@ -2388,11 +2674,13 @@ static int read_memory_progbuf_inner(struct target *target, target_addr_t addres
 			case CMDERR_NONE:
 				LOG_DEBUG("successful (partial?) memory read");
 				next_read_addr = read_addr + reads * size;
+				progbuf_batch_done(target, full, false);
 				break;
 			case CMDERR_BUSY:
 				LOG_DEBUG("memory read resulted in busy response");
 
 				increase_ac_busy_delay(target);
+				progbuf_batch_done(target, false, true);
 				riscv013_clear_abstract_error(target);
 
 				dmi_write(target, DMI_ABSTRACTAUTO, 0);
@@ -2572,41 +2860,34 @@ static int read_memory_progbuf_one(struct target *target, target_addr_t address,
 	return ERROR_OK;
 }
 
-/**
- * Read the requested memory, silently handling memory access errors.
- */
-static int read_memory_progbuf(struct target *target, target_addr_t address,
-		uint32_t size, uint32_t count, uint8_t *buffer)
+/* What read_memory_progbuf_prep() changed on a hart, so
+ * read_memory_progbuf_restore() can put it back. */
+struct progbuf_read_state {
+	uint64_t mstatus;
+	uint64_t mstatus_old;
+	uint64_t s0;
+	uint64_t s1;
+};
+
+/* Save s0 and s1, and write the program that loads the word at s0 into s1 and
+ * increments s0. */
+static int read_memory_progbuf_prep(struct target *target, uint32_t size,
+		struct progbuf_read_state *state)
 {
 	RISCV013_INFO(info);
 
-	int result = ERROR_OK;
-
-	LOG_DEBUG("reading %d words of %d bytes from 0x%" TARGET_PRIxADDR, count,
-			size, address);
-
-	select_dmi(target);
-
-	memset(buffer, 0, count*size);
-
-	if (execute_fence(target) != ERROR_OK)
-		return ERROR_FAIL;
-
-	if (count == 1)
-		return read_memory_progbuf_one(target, address, size, buffer);
-
-	uint64_t mstatus = 0;
-	uint64_t mstatus_old = 0;
-	if (modify_privilege(target, &mstatus, &mstatus_old) != ERROR_OK)
+	state->mstatus = 0;
+	state->mstatus_old = 0;
+	if (modify_privilege(target, &state->mstatus, &state->mstatus_old) != ERROR_OK)
 		return ERROR_FAIL;
+	uint64_t mstatus = state->mstatus;
 
 	/* s0 holds the next address to write to
 	 * s1 holds the next data value to write
 	 */
-	uint64_t s0, s1;
-	if (register_read(target, &s0, GDB_REGNO_S0) != ERROR_OK)
+	if (register_read(target, &state->s0, GDB_REGNO_S0) != ERROR_OK)
 		return ERROR_FAIL;
-	if (register_read(target, &s1, GDB_REGNO_S1) != ERROR_OK)
+	if (register_read(target, &state->s1, GDB_REGNO_S1) != ERROR_OK)
 		return ERROR_FAIL;
 
 	/* Write the program (load, increment) */
@@ -2635,10 +2916,31 @@ static int read_memory_progbuf(struct target *target, target_addr_t address,
 
 	if (riscv_program_ebreak(&program) != ERROR_OK)
 		return ERROR_FAIL;
-	if (riscv_program_write(&program) != ERROR_OK)
-		return ERROR_FAIL;
+	return riscv_program_write(&program);
+}
+
+static int read_memory_progbuf_restore(struct target *target,
+		const struct progbuf_read_state *state)
+{
+	riscv_set_register(target, GDB_REGNO_S0, state->s0);
+	riscv_set_register(target, GDB_REGNO_S1, state->s1);
+
+	/* Restore MSTATUS */
+	if (state->mstatus != state->mstatus_old)
+		if (register_write_direct(target, GDB_REGNO_MSTATUS, state->mstatus_old))
+			return ERROR_FAIL;
 
-	result = read_memory_progbuf_inner(target, address, size, count, buffer);
+	return ERROR_OK;
+}
+
+/**
+ * Read memory with the program written by read_memory_progbuf_prep(),
+ * silently handling memory access errors.
+ */
+static int read_memory_progbuf_prepped(struct target *target,
+		target_addr_t address, uint32_t size, uint32_t count, uint8_t *buffer)
+{
+	int result = read_memory_progbuf_inner(target, address, size, count, buffer);
 
 	if (result != ERROR_OK) {
 		/* The full read did not succeed, so we will try to read each word individually. */
@@ -2666,87 +2968,796 @@ static int read_memory_progbuf(struct target *target, target_addr_t address,
 		result = ERROR_OK;
 	}
 
-	riscv_set_register(target, GDB_REGNO_S0, s0);
-	riscv_set_register(target, GDB_REGNO_S1, s1);
-
-	/* Restore MSTATUS */
-	if (mstatus != mstatus_old)
-		if (register_write_direct(target, GDB_REGNO_MSTATUS, mstatus_old))
-			return ERROR_FAIL;
-
 	return result;
 }
 
-static int read_memory(struct target *target, target_addr_t address,
-		uint32_t size, uint32_t count, uint8_t *buffer)
-{
-	RISCV013_INFO(info);
-	if (info->progbufsize >= 2 && !riscv_prefer_sba)
-		return read_memory_progbuf(target, address, size, count, buffer);
+/* Don't bother other harts for less than this many words each. */
+#define RISCV_PARALLEL_READ_MIN_WORDS	256
 
-	if ((get_field(info->sbcs, DMI_SBCS_SBACCESS8) && size == 1) ||
-			(get_field(info->sbcs, DMI_SBCS_SBACCESS16) && size == 2) ||
-			(get_field(info->sbcs, DMI_SBCS_SBACCESS32) && size == 4) ||
-			(get_field(info->sbcs, DMI_SBCS_SBACCESS64) && size == 8) ||
-			(get_field(info->sbcs, DMI_SBCS_SBACCESS128) && size == 16)) {
-		if (get_field(info->sbcs, DMI_SBCS_SBVERSION) == 0)
-			return read_memory_bus_v0(target, address, size, count, buffer);
-		else if (get_field(info->sbcs, DMI_SBCS_SBVERSION) == 1)
-			return read_memory_bus_v1(target, address, size, count, buffer);
-	}
+/* One hart's share of a read_memory_progbuf_parallel(). */
+struct progbuf_read_slice {
+	struct target *target;
+	target_addr_t address;
+	uint32_t count;
+	uint8_t *buffer;
+	struct progbuf_read_state state;
+	/* The next address the hart will read from, which is the value in s0. */
+	riscv_addr_t read_addr;
+	bool prepped;
+	bool active;
+	bool failed;
+	struct riscv_batch *batch;
+	size_t reads;
+	size_t abstractcs_key;
+};
 
-	if (info->progbufsize >= 2)
-		return read_memory_progbuf(target, address, size, count, buffer);
+/* Start the s0 -> s1 -> data0 pipeline on the hart of a slice, like the
+ * beginning of read_memory_progbuf_inner(). */
+static int read_memory_progbuf_slice_start(struct progbuf_read_slice *slice,
+		uint32_t size)
+{
+	struct target *target = slice->target;
 
-	LOG_ERROR("Don't know how to read memory on this target.");
-	return ERROR_FAIL;
+	if (register_write_direct(target, GDB_REGNO_S0, slice->address) != ERROR_OK)
+		return ERROR_FAIL;
+	uint32_t command = access_register_command(target, GDB_REGNO_S1,
+			riscv_xlen(target),
+			AC_ACCESS_REGISTER_TRANSFER | AC_ACCESS_REGISTER_POSTEXEC);
+	if (execute_abstract_command(target, command) != ERROR_OK)
+		return ERROR_FAIL;
+	if (dmi_write(target, DMI_ABSTRACTAUTO,
+			1 << DMI_ABSTRACTAUTO_AUTOEXECDATA_OFFSET) != ERROR_OK)
+		return ERROR_FAIL;
+	/* Now dmi_data0 contains the first good result, and s1 the next memory
+	 * value. */
+	if (dmi_read_exec(target, NULL, DMI_DATA0) != ERROR_OK)
+		return ERROR_FAIL;
+	slice->read_addr = slice->address + 2 * size;
+	return ERROR_OK;
 }
 
-static int write_memory_bus_v0(struct target *target, target_addr_t address,
-		uint32_t size, uint32_t count, const uint8_t *buffer)
+/* Collect the results of the last batch of a slice. */
+static int read_memory_progbuf_slice_collect(struct progbuf_read_slice *slice,
+		uint32_t size)
 {
-	/*1) write sbaddress: for singlewrite and autoincrement, we need to write the address once*/
-	LOG_DEBUG("System Bus Access: size: %d\tcount:%d\tstart address: 0x%08"
-			TARGET_PRIxADDR, size, count, address);
-	dmi_write(target, DMI_SBADDRESS0, address);
-	int64_t value = 0;
-	int64_t access = 0;
-	riscv_addr_t offset = 0;
-	riscv_addr_t t_addr = 0;
-	const uint8_t *t_buffer = buffer + offset;
+	struct target *target = slice->target;
+	RISCV013_INFO(info);
 
-	/* B.8 Writing Memory, single write check if we write in one go */
-	if (count == 1) { /* count is in bytes here */
-		/* check the size */
-		switch (size) {
-			case 1:
-				value = t_buffer[0];
-				break;
-			case 2:
-				value = t_buffer[0]
-					| ((uint32_t) t_buffer[1] << 8);
-				break;
-			case 4:
-				value = t_buffer[0]
-					| ((uint32_t) t_buffer[1] << 8)
-					| ((uint32_t) t_buffer[2] << 16)
-					| ((uint32_t) t_buffer[3] << 24);
-				break;
-			default:
-				LOG_ERROR("unsupported access size: %d", size);
-				return ERROR_FAIL;
-		}
+	riscv_batch_finish(slice->batch);
 
-		access = 0;
-		access = set_field(access, DMI_SBCS_SBACCESS, size/2);
-		dmi_write(target, DMI_SBCS, access);
-		LOG_DEBUG("\r\naccess:  0x%08" PRIx64, access);
-		LOG_DEBUG("\r\nwrite_memory:SAB: ONE OFF: value 0x%08" PRIx64, value);
-		dmi_write(target, DMI_SBDATA0, value);
-		return ERROR_OK;
+	/* DMI busy is sticky, so the last read tells whether all of them worked. */
+	unsigned status = riscv_batch_get_dmi_read_op(slice->batch,
+			slice->abstractcs_key);
+	if (status == DMI_STATUS_BUSY)
+		increase_dmi_busy_delay(target);
+	if (status != DMI_STATUS_SUCCESS) {
+		LOG_DEBUG("parallel read on hart %d: DMI status %d",
+				riscv_current_hartid(target), status);
+		return ERROR_FAIL;
 	}
 
-	/*B.8 Writing Memory, using autoincrement*/
+	uint32_t abstractcs = riscv_batch_get_dmi_read_data(slice->batch,
+			slice->abstractcs_key);
+	while (get_field(abstractcs, DMI_ABSTRACTCS_BUSY))
+		if (dmi_read(target, &abstractcs, DMI_ABSTRACTCS) != ERROR_OK)
+			return ERROR_FAIL;
+	info->cmderr = get_field(abstractcs, DMI_ABSTRACTCS_CMDERR);
+	if (info->cmderr != CMDERR_NONE) {
+		LOG_DEBUG("parallel read on hart %d: cmderr %d",
+				riscv_current_hartid(target), info->cmderr);
+		if (info->cmderr == CMDERR_BUSY) {
+			increase_ac_busy_delay(target);
+			progbuf_batch_done(target, false, true);
+		}
+		riscv013_clear_abstract_error(target);
+		return ERROR_FAIL;
+	}
+	progbuf_batch_done(target, slice->reads == progbuf_batch_size(target), false);
+
+	for (size_t i = 0; i < slice->reads; i++) {
+		riscv_addr_t receive_addr = slice->read_addr + (i - 2) * size;
+		if (receive_addr < slice->address)
+			continue;
+		uint32_t value = riscv_batch_get_dmi_read_data(slice->batch, i);
+		write_to_buf(slice->buffer + receive_addr - slice->address, value, size);
+		log_memory_access(receive_addr, value, size, true);
+	}
+	slice->read_addr += slice->reads * size;
+
+	riscv_addr_t fin_addr = slice->address + slice->count * size;
+	if (slice->read_addr < fin_addr)
+		return ERROR_OK;
+
+	/* Drain the pipeline. */
+	slice->active = false;
+	if (dmi_write(target, DMI_ABSTRACTAUTO, 0) != ERROR_OK)
+		return ERROR_FAIL;
+	uint32_t value;
+	if (dmi_read(target, &value, DMI_DATA0) != ERROR_OK)
+		return ERROR_FAIL;
+	write_to_buf(slice->buffer + size * (slice->count - 2), value, size);
+	uint64_t value64;
+	if (register_read_direct(target, &value64, GDB_REGNO_S1) != ERROR_OK)
+		return ERROR_FAIL;
+	write_to_buf(slice->buffer + size * (slice->count - 1), value64, size);
+	return ERROR_OK;
+}
+
+/**
+ * Split a large read between target and other halted harts in its SMP group,
+ * one per DM. Every DM has just one abstract command engine, so harts behind
+ * the same DM can't read at the same time, but harts behind different DMs can.
+ * Each hart runs the read_memory_progbuf_inner() pipeline over its own slice
+ * of the range, and one JTAG queue flush carries a batch for every DM.
+ *
+ * Returns ERROR_TARGET_RESOURCE_NOT_AVAILABLE if there is nobody to help.
+ */
+static int read_memory_progbuf_parallel(struct target *target,
+		target_addr_t address, uint32_t size, uint32_t count, uint8_t *buffer)
+{
+	if (!riscv_parallel_read || !target->smp || riscv_rtos_enabled(target))
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+
+	unsigned target_count = 1;
+	for (struct target_list *tlist = target->head; tlist; tlist = tlist->next)
+		target_count++;
+
+	struct progbuf_read_slice slices[target_count];
+	memset(slices, 0, sizeof(slices));
+	unsigned slice_count = 0;
+	slices[slice_count++].target = target;
+	for (struct target_list *tlist = target->head; tlist; tlist = tlist->next) {
+		struct target *t = tlist->target;
+		if (count / (slice_count + 1) < RISCV_PARALLEL_READ_MIN_WORDS)
+			break;
+		if (t == target || !target_was_examined(t) ||
+				t->state != TARGET_HALTED || riscv_info(t)->dtm_version != 1 ||
+				riscv_xlen(t) != riscv_xlen(target) ||
+				get_info(t)->progbufsize < 2)
+			continue;
+		unsigned i;
+		for (i = 0; i < slice_count; i++) {
+			if (get_dm(slices[i].target) == get_dm(t))
+				break;
+		}
+		if (i == slice_count)
+			slices[slice_count++].target = t;
+	}
+	if (slice_count < 2)
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+
+	LOG_DEBUG("reading %d words of %d bytes from 0x%" TARGET_PRIxADDR
+			" with %d harts", count, size, address, slice_count);
+
+	uint32_t words_per_slice = count / slice_count;
+	for (unsigned i = 0; i < slice_count; i++) {
+		struct progbuf_read_slice *slice = &slices[i];
+		slice->address = address + i * words_per_slice * size;
+		slice->buffer = buffer + i * words_per_slice * size;
+		slice->count = words_per_slice;
+		if (i == slice_count - 1)
+			slice->count = count - i * words_per_slice;
+	}
+
+	int result = ERROR_OK;
+	for (unsigned i = 0; i < slice_count; i++) {
+		struct progbuf_read_slice *slice = &slices[i];
+		struct target *t = slice->target;
+		if (t != target) {
+			if (riscv_set_current_hartid(t, riscv_current_hartid(t)) != ERROR_OK ||
+					execute_fence(t) != ERROR_OK) {
+				result = ERROR_FAIL;
+				goto restore;
+			}
+		}
+		if (read_memory_progbuf_prep(t, size, &slice->state) != ERROR_OK) {
+			result = ERROR_FAIL;
+			goto restore;
+		}
+		slice->prepped = true;
+		slice->active = true;
+		if (read_memory_progbuf_slice_start(slice, size) != ERROR_OK) {
+			slice->active = false;
+			slice->failed = true;
+		}
+	}
+
+	bool active = true;
+	while (active) {
+		for (unsigned i = 0; i < slice_count; i++) {
+			struct progbuf_read_slice *slice = &slices[i];
+			if (!slice->active)
+				continue;
+			riscv013_info_t *info = get_info(slice->target);
+			unsigned batch_size = progbuf_batch_size(slice->target);
+			slice->batch = riscv_batch_alloc(slice->target, batch_size + 1,
+					info->dmi_busy_delay + info->ac_busy_delay);
+			slice->reads = 0;
+			riscv_addr_t fin_addr = slice->address + slice->count * size;
+			for (riscv_addr_t addr = slice->read_addr; addr < fin_addr;
+					addr += size) {
+				riscv_batch_add_dmi_read(slice->batch, DMI_DATA0);
+				if (++slice->reads == batch_size)
+					break;
+			}
+			/* Reading abstractcs does not trigger autoexec. */
+			slice->abstractcs_key = riscv_batch_add_dmi_read(slice->batch,
+					DMI_ABSTRACTCS);
+		}
+
+		for (unsigned i = 0; i < slice_count; i++) {
+			if (!slices[i].active)
+				continue;
+			select_dmi(slices[i].target);
+			riscv_batch_queue(slices[i].batch);
+		}
+		keep_alive();
+		if (jtag_execute_queue() != ERROR_OK) {
+			LOG_ERROR("Unable to execute JTAG queue");
+			result = ERROR_FAIL;
+		}
+
+		active = false;
+		for (unsigned i = 0; i < slice_count; i++) {
+			struct progbuf_read_slice *slice = &slices[i];
+			if (!slice->active)
+				continue;
+			if (result == ERROR_OK &&
+					read_memory_progbuf_slice_collect(slice, size) != ERROR_OK) {
+				slice->active = false;
+				slice->failed = true;
+			}
+			riscv_batch_free(slice->batch);
+			slice->batch = NULL;
+			active |= slice->active;
+		}
+		if (result != ERROR_OK)
+			goto restore;
+	}
+
+	/* Give slices that ran into trouble another go, one hart at a time, with
+	 * the usual fallback to single word reads. */
+	for (unsigned i = 0; i < slice_count; i++) {
+		struct progbuf_read_slice *slice = &slices[i];
+		if (!slice->failed)
+			continue;
+		dmi_write(slice->target, DMI_ABSTRACTAUTO, 0);
+		LOG_DEBUG("reading slice at 0x%" TARGET_PRIxADDR " again",
+				slice->address);
+		result = read_memory_progbuf_prepped(slice->target, slice->address,
+				size, slice->count, slice->buffer);
+		if (result != ERROR_OK)
+			goto restore;
+	}
+
+restore:
+	for (unsigned i = 0; i < slice_count; i++) {
+		struct progbuf_read_slice *slice = &slices[i];
+		if (!slice->prepped)
+			continue;
+		if (result != ERROR_OK)
+			dmi_write(slice->target, DMI_ABSTRACTAUTO, 0);
+		if (read_memory_progbuf_restore(slice->target, &slice->state) != ERROR_OK)
+			result = ERROR_FAIL;
+	}
+
+	return result;
+}
+
+/**
+ * Read the requested memory, silently handling memory access errors.
+ */
+static int read_memory_progbuf(struct target *target, target_addr_t address,
+		uint32_t size, uint32_t count, uint8_t *buffer)
+{
+	int result = ERROR_OK;
+
+	LOG_DEBUG("reading %d words of %d bytes from 0x%" TARGET_PRIxADDR, count,
+			size, address);
+
+	select_dmi(target);
+
+	memset(buffer, 0, count*size);
+
+	if (execute_fence(target) != ERROR_OK)
+		return ERROR_FAIL;
+
+	if (count == 1)
+		return read_memory_progbuf_one(target, address, size, buffer);
+
+	result = read_memory_progbuf_parallel(target, address, size, count, buffer);
+	if (result != ERROR_TARGET_RESOURCE_NOT_AVAILABLE)
+		return result;
+
+	struct progbuf_read_state state;
+	if (read_memory_progbuf_prep(target, size, &state) != ERROR_OK)
+		return ERROR_FAIL;
+
+	result = read_memory_progbuf_prepped(target, address, size, count, buffer);
+
+	if (read_memory_progbuf_restore(target, &state) != ERROR_OK)
+		return ERROR_FAIL;
+
+	return result;
+}
+
+/**
+ * Read the same address count times over the system bus, as quickly as the
+ * bus allows and without disturbing the harts. Every read of sbdata0 triggers
+ * the next bus access. The values are samples, so when the DMI or the bus was
+ * busy the delay is increased and the whole set is simply read again.
+ */
+static int riscv013_sample_memory(struct target *target, target_addr_t address,
+		uint32_t size, uint32_t count, uint8_t *buffer)
+{
+	RISCV013_INFO(info);
+
+	if (get_field(info->sbcs, DMI_SBCS_SBVERSION) != 1 ||
+			!((get_field(info->sbcs, DMI_SBCS_SBACCESS32) && size == 4) ||
+				(get_field(info->sbcs, DMI_SBCS_SBACCESS64) && size == 8)))
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+
+	for (unsigned attempt = 0; attempt < 10; attempt++) {
+		uint32_t sbcs_write = sb_sbaccess(size);
+		sbcs_write = set_field(sbcs_write, DMI_SBCS_SBREADONADDR, 1);
+		sbcs_write = set_field(sbcs_write, DMI_SBCS_SBREADONDATA, 1);
+		if (dmi_write(target, DMI_SBCS, sbcs_write) != ERROR_OK)
+			return ERROR_FAIL;
+		/* This address write will trigger the first read. */
+		if (sb_write_address(target, address) != ERROR_OK)
+			return ERROR_FAIL;
+
+		struct riscv_batch *batch = riscv_batch_alloc(target,
+				count * size / 4 + 2,
+				info->dmi_busy_delay + info->bus_master_read_delay);
+		if (!batch)
+			return ERROR_FAIL;
+		size_t key = 0;
+		for (uint32_t i = 0; i < count; i++) {
+			/* sbdata0 must be read last, since that triggers the next
+			 * access. */
+			if (size == 8)
+				riscv_batch_add_dmi_read(batch, DMI_SBDATA1);
+			key = riscv_batch_add_dmi_read(batch, DMI_SBDATA0);
+		}
+		if (batch_run(target, batch) != ERROR_OK) {
+			riscv_batch_free(batch);
+			return ERROR_FAIL;
+		}
+
+		/* A busy response is sticky, so if the last read went through then
+		 * so did every read before it. */
+		unsigned status = riscv_batch_get_dmi_read_op(batch, key);
+		if (status == DMI_STATUS_SUCCESS) {
+			for (uint32_t i = 0; i < count; i++) {
+				size_t k = size == 8 ? 2 * i : i;
+				uint64_t value = riscv_batch_get_dmi_read_data(batch, k);
+				if (size == 8)
+					value = (value << 32) | riscv_batch_get_dmi_read_data(batch, k + 1);
+				buf_set_u64(buffer + i * size, 0, 8 * size, value);
+			}
+		}
+		riscv_batch_free(batch);
+		if (status == DMI_STATUS_BUSY)
+			increase_dmi_busy_delay(target);
+		else if (status != DMI_STATUS_SUCCESS)
+			return ERROR_FAIL;
+
+		/* "Writes to sbcs while sbbusy is high result in undefined behavior.
+		 * A debugger must not write to sbcs until it reads sbbusy as 0." */
+		uint32_t sbcs_read;
+		if (read_sbcs_nonbusy(target, &sbcs_read) != ERROR_OK)
+			return ERROR_FAIL;
+		/* Stop reading, and clear any errors. */
+		sbcs_write = set_field(sbcs_write, DMI_SBCS_SBREADONDATA, 0);
+		sbcs_write |= sbcs_read & (DMI_SBCS_SBBUSYERROR | DMI_SBCS_SBERROR);
+		if (dmi_write(target, DMI_SBCS, sbcs_write) != ERROR_OK)
+			return ERROR_FAIL;
+
+		if (get_field(sbcs_read, DMI_SBCS_SBERROR)) {
+			LOG_ERROR("System bus error 0x%x while sampling 0x%" TARGET_PRIxADDR,
+					(unsigned) get_field(sbcs_read, DMI_SBCS_SBERROR), address);
+			return ERROR_FAIL;
+		}
+		if (get_field(sbcs_read, DMI_SBCS_SBBUSYERROR)) {
+			info->bus_master_read_delay += info->bus_master_read_delay / 10 + 1;
+			continue;
+		}
+		if (status == DMI_STATUS_SUCCESS)
+			return ERROR_OK;
+	}
+
+	LOG_ERROR("System bus stayed busy while sampling 0x%" TARGET_PRIxADDR,
+			address);
+	return ERROR_FAIL;
+}
+
+/**
+ * Read every address in config once over the system bus. Each access is
+ * started by writing sbaddress0 with sbreadonaddr set, and the batch idles
+ * long enough after it for the bus access to complete before sbdata0 is read.
+ * sbcs is read at the end, so a single batch tells whether any access failed.
+ * A failed set is dropped after the delays have been increased, since the
+ * next one comes along soon enough.
+ */
+static int riscv013_sample_memory_set(struct target *target,
+		const riscv_sample_config_t *config, uint64_t *values)
+{
+	RISCV013_INFO(info);
+
+	if (get_field(info->sbcs, DMI_SBCS_SBVERSION) != 1)
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	for (unsigned i = 0; i < config->count; i++) {
+		unsigned size = config->size[i];
+		if (!((get_field(info->sbcs, DMI_SBCS_SBACCESS8) && size == 1) ||
+				(get_field(info->sbcs, DMI_SBCS_SBACCESS16) && size == 2) ||
+				(get_field(info->sbcs, DMI_SBCS_SBACCESS32) && size == 4) ||
+				(get_field(info->sbcs, DMI_SBCS_SBACCESS64) && size == 8)))
+			return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	}
+
+	unsigned sbasize = get_field(info->sbcs, DMI_SBCS_SBASIZE);
+	struct riscv_batch *batch = riscv_batch_alloc(target,
+			5 * config->count + 2,
+			info->dmi_busy_delay + info->bus_master_read_delay);
+	if (!batch)
+		return ERROR_FAIL;
+
+	size_t keys[RISCV_SAMPLE_MAX];
+	uint32_t last_sbcs = 0;
+	for (unsigned i = 0; i < config->count; i++) {
+		uint32_t sbcs_write = sb_sbaccess(config->size[i]);
+		sbcs_write = set_field(sbcs_write, DMI_SBCS_SBREADONADDR, 1);
+		if (i == 0 || sbcs_write != last_sbcs)
+			riscv_batch_add_dmi_write(batch, DMI_SBCS, sbcs_write);
+		last_sbcs = sbcs_write;
+		if (sbasize > 32)
+			riscv_batch_add_dmi_write(batch, DMI_SBADDRESS1,
+					(uint64_t) config->address[i] >> 32);
+		riscv_batch_add_dmi_write(batch, DMI_SBADDRESS0, config->address[i]);
+		if (config->size[i] == 8)
+			riscv_batch_add_dmi_read(batch, DMI_SBDATA1);
+		keys[i] = riscv_batch_add_dmi_read(batch, DMI_SBDATA0);
+	}
+	size_t sbcs_key = riscv_batch_add_dmi_read(batch, DMI_SBCS);
+
+	if (batch_run(target, batch) != ERROR_OK) {
+		riscv_batch_free(batch);
+		return ERROR_FAIL;
+	}
+
+	/* A busy response is sticky, so if the last read went through then so
+	 * did every scan before it. */
+	unsigned status = riscv_batch_get_dmi_read_op(batch, sbcs_key);
+	uint32_t sbcs_read = riscv_batch_get_dmi_read_data(batch, sbcs_key);
+	if (status == DMI_STATUS_SUCCESS) {
+		for (unsigned i = 0; i < config->count; i++) {
+			uint64_t value = riscv_batch_get_dmi_read_data(batch, keys[i]);
+			if (config->size[i] == 8)
+				value |= (uint64_t) riscv_batch_get_dmi_read_data(batch,
+						keys[i] - 1) << 32;
+			/* sbdata0 bits above the access size can hold anything. */
+			if (config->size[i] < 8)
+				value &= (1ULL << (8 * config->size[i])) - 1;
+			values[i] = value;
+		}
+	}
+	riscv_batch_free(batch);
+
+	if (status == DMI_STATUS_SUCCESS && !get_field(sbcs_read, DMI_SBCS_SBBUSY) &&
+			!(sbcs_read & (DMI_SBCS_SBBUSYERROR | DMI_SBCS_SBERROR)))
+		return ERROR_OK;
+
+	if (status == DMI_STATUS_BUSY)
+		increase_dmi_busy_delay(target);
+	else if (status != DMI_STATUS_SUCCESS)
+		return ERROR_FAIL;
+
+	/* "Writes to sbcs while sbbusy is high result in undefined behavior.
+	 * A debugger must not write to sbcs until it reads sbbusy as 0." */
+	if (read_sbcs_nonbusy(target, &sbcs_read) != ERROR_OK)
+		return ERROR_FAIL;
+	if (get_field(sbcs_read, DMI_SBCS_SBBUSYERROR))
+		info->bus_master_read_delay += info->bus_master_read_delay / 10 + 1;
+	if (get_field(sbcs_read, DMI_SBCS_SBERROR))
+		LOG_DEBUG("System bus error 0x%x while sampling memory",
+				(unsigned) get_field(sbcs_read, DMI_SBCS_SBERROR));
+	/* Clear any errors. */
+	if (dmi_write(target, DMI_SBCS,
+			sbcs_read & (DMI_SBCS_SBBUSYERROR | DMI_SBCS_SBERROR)) != ERROR_OK)
+		return ERROR_FAIL;
+	return ERROR_WAIT;
+}
+
+/**
+ * Sample the PC of the current hart by halting it, reading dpc and resuming
+ * it again, up to count times in a single batch. On return *sampled is the
+ * number of samples that were taken. A sample fails when the hart didn't halt
+ * in time for the abstract command, and all the ones after it in the batch
+ * then fail as well. If the hart halted by itself, it is resumed anyway.
+ */
+static int riscv013_sample_pc(struct target *target, uint32_t count,
+		uint64_t *samples, uint32_t *sampled)
+{
+	RISCV013_INFO(info);
+	RISCV_INFO(r);
+	*sampled = 0;
+
+	if (!info->abstract_read_csr_supported)
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+
+	unsigned xlen = riscv_xlen(target);
+	uint32_t command = access_register_command(target, GDB_REGNO_DPC, xlen,
+			AC_ACCESS_REGISTER_TRANSFER);
+	uint32_t dmcontrol = set_hartsel(DMI_DMCONTROL_DMACTIVE, r->current_hartid);
+	get_dm(target)->current_hartid = r->current_hartid;
+
+	struct riscv_batch *batch = riscv_batch_alloc(target, count * 6 + 2,
+			info->dmi_busy_delay + info->ac_busy_delay);
+	if (!batch)
+		return ERROR_FAIL;
+	size_t keys[count][3];
+	for (uint32_t i = 0; i < count; i++) {
+		riscv_batch_add_dmi_write(batch, DMI_DMCONTROL,
+				dmcontrol | DMI_DMCONTROL_HALTREQ);
+		riscv_batch_add_dmi_write(batch, DMI_COMMAND, command);
+		keys[i][0] = riscv_batch_add_dmi_read(batch, DMI_DATA0);
+		if (xlen > 32)
+			keys[i][1] = riscv_batch_add_dmi_read(batch, DMI_DATA1);
+		riscv_batch_add_dmi_write(batch, DMI_DMCONTROL,
+				dmcontrol | DMI_DMCONTROL_RESUMEREQ);
+		keys[i][2] = riscv_batch_add_dmi_read(batch, DMI_ABSTRACTCS);
+	}
+	riscv_batch_add_dmi_write(batch, DMI_DMCONTROL, dmcontrol);
+
+	if (batch_run(target, batch) != ERROR_OK) {
+		riscv_batch_free(batch);
+		return ERROR_FAIL;
+	}
+
+	unsigned status = DMI_STATUS_SUCCESS;
+	uint32_t abstractcs = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		status = riscv_batch_get_dmi_read_op(batch, keys[i][2]);
+		if (status != DMI_STATUS_SUCCESS)
+			break;
+		abstractcs = riscv_batch_get_dmi_read_data(batch, keys[i][2]);
+		if (get_field(abstractcs, DMI_ABSTRACTCS_CMDERR) != CMDERR_NONE)
+			break;
+		samples[i] = riscv_batch_get_dmi_read_data(batch, keys[i][0]);
+		if (xlen > 32)
+			samples[i] |= (uint64_t) riscv_batch_get_dmi_read_data(batch,
+					keys[i][1]) << 32;
+		(*sampled)++;
+	}
+	riscv_batch_free(batch);
+
+	if (*sampled == count)
+		return ERROR_OK;
+
+	LOG_DEBUG("took %d of %d PC samples; status=%d, abstractcs=0x%x",
+			*sampled, count, status, abstractcs);
+	if (status == DMI_STATUS_BUSY)
+		increase_dmi_busy_delay(target);
+	else if (status != DMI_STATUS_SUCCESS)
+		return ERROR_FAIL;
+
+	info->cmderr = get_field(abstractcs, DMI_ABSTRACTCS_CMDERR);
+	if (info->cmderr != CMDERR_NONE) {
+		/* Most likely the hart wasn't halted yet. Give it more time. */
+		if (info->cmderr == CMDERR_HALT_RESUME || info->cmderr == CMDERR_BUSY)
+			increase_ac_busy_delay(target);
+		if (wait_for_idle(target, &abstractcs) != ERROR_OK)
+			return ERROR_FAIL;
+		if (dmi_write(target, DMI_ABSTRACTCS, set_field(0, DMI_ABSTRACTCS_CMDERR,
+						info->cmderr)) != ERROR_OK)
+			return ERROR_FAIL;
+	}
+
+	/* Some of the writes may not have made it, so make sure the hart ends up
+	 * running. */
+	uint32_t dmstatus;
+	if (dmi_write(target, DMI_DMCONTROL, dmcontrol) != ERROR_OK)
+		return ERROR_FAIL;
+	if (dmstatus_read(target, &dmstatus, true) != ERROR_OK)
+		return ERROR_FAIL;
+	if (get_field(dmstatus, DMI_DMSTATUS_ALLHALTED)) {
+		if (dmi_write(target, DMI_DMCONTROL, dmcontrol | DMI_DMCONTROL_RESUMEREQ) != ERROR_OK)
+			return ERROR_FAIL;
+		if (dmi_write(target, DMI_DMCONTROL, dmcontrol) != ERROR_OK)
+			return ERROR_FAIL;
+	}
+	return ERROR_OK;
+}
+
+/**
+ * Single step the current hart count times in one batch, with dcsr.step
+ * already set: every step is a resumereq followed by an abstract command that
+ * reads dpc. Nothing else is read or written between steps.
+ *
+ * If a step hasn't finished by the time its command runs, the command fails,
+ * but the resumereqs after it still take effect until a scan gets a busy
+ * response. So the caller learns both how many steps were confirmed with
+ * their dpc, and how many resumereqs took effect. The delay is increased so
+ * it doesn't happen again.
+ */
+static int riscv013_step_batch(struct target *target, uint32_t count,
+		uint64_t *pcs, uint32_t *stepped, uint32_t *resumed)
+{
+	RISCV013_INFO(info);
+	RISCV_INFO(r);
+	*stepped = 0;
+	*resumed = 0;
+
+	if (!info->abstract_read_csr_supported)
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+
+	unsigned xlen = riscv_xlen(target);
+	uint32_t command = access_register_command(target, GDB_REGNO_DPC, xlen,
+			AC_ACCESS_REGISTER_TRANSFER);
+	uint32_t dmcontrol = set_hartsel(DMI_DMCONTROL_DMACTIVE, r->current_hartid);
+	get_dm(target)->current_hartid = r->current_hartid;
+
+	struct riscv_batch *batch = riscv_batch_alloc(target, count * 5 + 2,
+			info->dmi_busy_delay + info->ac_busy_delay);
+	if (!batch)
+		return ERROR_FAIL;
+	/* Whatever scan precedes a resume request tells whether it took effect,
+	 * see below. */
+	size_t start_key = riscv_batch_add_dmi_read(batch, DMI_DMSTATUS);
+	size_t keys[count][3];
+	for (uint32_t i = 0; i < count; i++) {
+		riscv_batch_add_dmi_write(batch, DMI_DMCONTROL,
+				dmcontrol | DMI_DMCONTROL_RESUMEREQ);
+		riscv_batch_add_dmi_write(batch, DMI_COMMAND, command);
+		keys[i][0] = riscv_batch_add_dmi_read(batch, DMI_DATA0);
+		if (xlen > 32)
+			keys[i][1] = riscv_batch_add_dmi_read(batch, DMI_DATA1);
+		keys[i][2] = riscv_batch_add_dmi_read(batch, DMI_ABSTRACTCS);
+	}
+	riscv_batch_add_dmi_write(batch, DMI_DMCONTROL, dmcontrol);
+
+	if (batch_run(target, batch) != ERROR_OK) {
+		riscv_batch_free(batch);
+		return ERROR_FAIL;
+	}
+
+	/* The DM ignores a scan whose response reports the previous operation
+	 * as busy, and every scan after it. So a resume request took effect when
+	 * the operation before it, the dmstatus read or the abstractcs read of
+	 * the previous step, succeeded. */
+	while (*resumed < count) {
+		size_t key = *resumed ? keys[*resumed - 1][2] : start_key;
+		if (riscv_batch_get_dmi_read_op(batch, key) != DMI_STATUS_SUCCESS)
+			break;
+		(*resumed)++;
+	}
+
+	unsigned status = DMI_STATUS_SUCCESS;
+	uint32_t abstractcs = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		status = riscv_batch_get_dmi_read_op(batch, keys[i][2]);
+		if (status != DMI_STATUS_SUCCESS)
+			break;
+		abstractcs = riscv_batch_get_dmi_read_data(batch, keys[i][2]);
+		if (get_field(abstractcs, DMI_ABSTRACTCS_CMDERR) != CMDERR_NONE)
+			break;
+		pcs[i] = riscv_batch_get_dmi_read_data(batch, keys[i][0]);
+		if (xlen > 32)
+			pcs[i] |= (uint64_t) riscv_batch_get_dmi_read_data(batch,
+					keys[i][1]) << 32;
+		(*stepped)++;
+	}
+	riscv_batch_free(batch);
+
+	if (*stepped == count)
+		return ERROR_OK;
+
+	LOG_DEBUG("confirmed %d of %d steps (%d resumed); status=%d, abstractcs=0x%x",
+			*stepped, count, *resumed, status, abstractcs);
+	if (status == DMI_STATUS_BUSY)
+		increase_dmi_busy_delay(target);
+	else if (status != DMI_STATUS_SUCCESS)
+		return ERROR_FAIL;
+
+	info->cmderr = get_field(abstractcs, DMI_ABSTRACTCS_CMDERR);
+	if (info->cmderr != CMDERR_NONE) {
+		if (info->cmderr == CMDERR_HALT_RESUME || info->cmderr == CMDERR_BUSY)
+			increase_ac_busy_delay(target);
+		if (wait_for_idle(target, &abstractcs) != ERROR_OK)
+			return ERROR_FAIL;
+		if (dmi_write(target, DMI_ABSTRACTCS, set_field(0, DMI_ABSTRACTCS_CMDERR,
+						info->cmderr)) != ERROR_OK)
+			return ERROR_FAIL;
+	}
+
+	/* The last step may still be in progress. */
+	uint32_t dmstatus;
+	for (unsigned i = 0; i < 256; i++) {
+		if (dmstatus_read(target, &dmstatus, true) != ERROR_OK)
+			return ERROR_FAIL;
+		if (get_field(dmstatus, DMI_DMSTATUS_ALLHALTED))
+			return ERROR_OK;
+	}
+	LOG_ERROR("Hart %d did not halt after a single step; dmstatus=0x%x",
+			r->current_hartid, dmstatus);
+	return ERROR_FAIL;
+}
+
+static int read_memory(struct target *target, target_addr_t address,
+		uint32_t size, uint32_t count, uint8_t *buffer)
+{
+	RISCV013_INFO(info);
+	/* The program buffer can only be used while the hart is halted, but the
+	 * system bus can also be accessed while it is running, e.g. to feed an
+	 * algorithm started with riscv_start_algorithm(). */
+	if (info->progbufsize >= 2 && !riscv_prefer_sba &&
+			target->state != TARGET_RUNNING)
+		return read_memory_progbuf(target, address, size, count, buffer);
+
+	if ((get_field(info->sbcs, DMI_SBCS_SBACCESS8) && size == 1) ||
+			(get_field(info->sbcs, DMI_SBCS_SBACCESS16) && size == 2) ||
+			(get_field(info->sbcs, DMI_SBCS_SBACCESS32) && size == 4) ||
+			(get_field(info->sbcs, DMI_SBCS_SBACCESS64) && size == 8) ||
+			(get_field(info->sbcs, DMI_SBCS_SBACCESS128) && size == 16)) {
+		if (get_field(info->sbcs, DMI_SBCS_SBVERSION) == 0)
+			return read_memory_bus_v0(target, address, size, count, buffer);
+		else if (get_field(info->sbcs, DMI_SBCS_SBVERSION) == 1)
+			return read_memory_bus_v1(target, address, size, count, buffer);
+	}
+
+	if (info->progbufsize >= 2)
+		return read_memory_progbuf(target, address, size, count, buffer);
+
+	LOG_ERROR("Don't know how to read memory on this target.");
+	return ERROR_FAIL;
+}
+
+static int write_memory_bus_v0(struct target *target, target_addr_t address,
+		uint32_t size, uint32_t count, const uint8_t *buffer)
+{
+	/*1) write sbaddress: for singlewrite and autoincrement, we need to write the address once*/
+	LOG_DEBUG("System Bus Access: size: %d\tcount:%d\tstart address: 0x%08"
+			TARGET_PRIxADDR, size, count, address);
+	dmi_write(target, DMI_SBADDRESS0, address);
+	int64_t value = 0;
+	int64_t access = 0;
+	riscv_addr_t offset = 0;
+	riscv_addr_t t_addr = 0;
+	const uint8_t *t_buffer = buffer + offset;
+
+	/* B.8 Writing Memory, single write check if we write in one go */
+	if (count == 1) { /* count is in bytes here */
+		/* check the size */
+		switch (size) {
+			case 1:
+				value = t_buffer[0];
+				break;
+			case 2:
+				value = t_buffer[0]
+					| ((uint32_t) t_buffer[1] << 8);
+				break;
+			case 4:
+				value = t_buffer[0]
+					| ((uint32_t) t_buffer[1] << 8)
+					| ((uint32_t) t_buffer[2] << 16)
+					| ((uint32_t) t_buffer[3] << 24);
+				break;
+			default:
+				LOG_ERROR("unsupported access size: %d", size);
+				return ERROR_FAIL;
+		}
+
+		access = 0;
+		access = set_field(access, DMI_SBCS_SBACCESS, size/2);
+		dmi_write(target, DMI_SBCS, access);
+		LOG_DEBUG("\r\naccess:  0x%08" PRIx64, access);
+		LOG_DEBUG("\r\nwrite_memory:SAB: ONE OFF: value 0x%08" PRIx64, value);
+		dmi_write(target, DMI_SBDATA0, value);
+		return ERROR_OK;
+	}
+
+	/*B.8 Writing Memory, using autoincrement*/
 
 	access = 0;
 	access = set_field(access, DMI_SBCS_SBACCESS, size/2);
@@ -2790,67 +3801,129 @@ static int write_memory_bus_v0(struct target *target, target_addr_t address,
 	return ERROR_OK;
 }
 
+/**
+ * Write words first through count-1 to the sbdata registers. Writing sbdata0
+ * starts each bus access. The writes are queued in batches, so a large number
+ * of them go out in a single JTAG queue flush. sbcs is only read at the end
+ * of every batch, so errors are noticed late but without an extra round trip.
+ *
+ * On return, *busy is set if either the DMI or the system bus reported busy,
+ * in which case the caller must recover and resume from the address the bus
+ * reached. *sbcs holds the value of sbcs read at the end of the last batch.
+ */
+static int write_memory_bus_v1_batch(struct target *target,
+		target_addr_t address, uint32_t size, uint32_t first, uint32_t count,
+		const uint8_t *buffer, uint32_t *sbcs, bool *busy)
+{
+	RISCV013_INFO(info);
+	const unsigned sbdata_count = (size + 3) / 4;
+
+	*busy = false;
+	*sbcs = 0;
+
+	uint32_t i = first;
+	while (i < count) {
+		struct riscv_batch *batch = riscv_batch_alloc(target, SB_BATCH_SCANS,
+				info->dmi_busy_delay + info->bus_master_write_delay);
+
+		/* Leave room for the trailing sbcs read. */
+		while (i < count && riscv_batch_available_scans(batch) > sbdata_count) {
+			const uint8_t *p = buffer + i * size;
+			/* sbdata0 must be written last, since writing it triggers the
+			 * bus access. */
+			for (int j = sbdata_count - 1; j >= 0; j--) {
+				uint32_t value = buf_get_u32(p + j * 4, 0, 8 * MIN(size, 4));
+				riscv_batch_add_dmi_write(batch, DMI_SBDATA0 + j, value);
+				log_memory_access(address + i * size + j * 4, value,
+						MIN(size, 4), false);
+			}
+			i++;
+		}
+		size_t sbcs_key = riscv_batch_add_dmi_read(batch, DMI_SBCS);
+
+		if (batch_run(target, batch) != ERROR_OK) {
+			riscv_batch_free(batch);
+			return ERROR_FAIL;
+		}
+
+		/* A busy response is sticky, so if the final sbcs read went through
+		 * then so did every write before it. */
+		unsigned status = riscv_batch_get_dmi_read_op(batch, sbcs_key);
+		if (status == DMI_STATUS_BUSY) {
+			*busy = true;
+		} else if (status != DMI_STATUS_SUCCESS) {
+			LOG_ERROR("Failed to read sbcs; status=%d", status);
+			riscv_batch_free(batch);
+			return ERROR_FAIL;
+		} else {
+			*sbcs = riscv_batch_get_dmi_read_data(batch, sbcs_key);
+			if (get_field(*sbcs, DMI_SBCS_SBBUSYERROR))
+				*busy = true;
+		}
+
+		riscv_batch_free(batch);
+
+		if (*busy) {
+			/* Clears the sticky DMI busy condition, if that's what we saw,
+			 * so the caller can talk to the DM again. */
+			if (status == DMI_STATUS_BUSY)
+				increase_dmi_busy_delay(target);
+			return ERROR_OK;
+		}
+		if (get_field(*sbcs, DMI_SBCS_SBERROR))
+			return ERROR_OK;
+	}
+
+	return ERROR_OK;
+}
+
 static int write_memory_bus_v1(struct target *target, target_addr_t address,
 		uint32_t size, uint32_t count, const uint8_t *buffer)
 {
 	RISCV013_INFO(info);
 	uint32_t sbcs = sb_sbaccess(size);
 	sbcs = set_field(sbcs, DMI_SBCS_SBAUTOINCREMENT, 1);
-	dmi_write(target, DMI_SBCS, sbcs);
+	if (dmi_write(target, DMI_SBCS, sbcs) != ERROR_OK)
+		return ERROR_FAIL;
 
 	target_addr_t next_address = address;
 	target_addr_t end_address = address + count * size;
 
-	sb_write_address(target, next_address);
+	if (sb_write_address(target, next_address) != ERROR_OK)
+		return ERROR_FAIL;
 	while (next_address < end_address) {
-		for (uint32_t i = (next_address - address) / size; i < count; i++) {
-			const uint8_t *p = buffer + i * size;
-			if (size > 12)
-				dmi_write(target, DMI_SBDATA3,
-						((uint32_t) p[12]) |
-						(((uint32_t) p[13]) << 8) |
-						(((uint32_t) p[14]) << 16) |
-						(((uint32_t) p[15]) << 24));
-			if (size > 8)
-				dmi_write(target, DMI_SBDATA2,
-						((uint32_t) p[8]) |
-						(((uint32_t) p[9]) << 8) |
-						(((uint32_t) p[10]) << 16) |
-						(((uint32_t) p[11]) << 24));
-			if (size > 4)
-				dmi_write(target, DMI_SBDATA1,
-						((uint32_t) p[4]) |
-						(((uint32_t) p[5]) << 8) |
-						(((uint32_t) p[6]) << 16) |
-						(((uint32_t) p[7]) << 24));
-			uint32_t value = p[0];
-			if (size > 2) {
-				value |= ((uint32_t) p[2]) << 16;
-				value |= ((uint32_t) p[3]) << 24;
-			}
-			if (size > 1)
-				value |= ((uint32_t) p[1]) << 8;
-			dmi_write(target, DMI_SBDATA0, value);
-
-			log_memory_access(address + i * size, value, size, false);
-
-			if (info->bus_master_write_delay) {
-				jtag_add_runtest(info->bus_master_write_delay, TAP_IDLE);
-				if (jtag_execute_queue() != ERROR_OK) {
-					LOG_ERROR("Failed to scan idle sequence");
-					return ERROR_FAIL;
-				}
-			}
-		}
+		bool busy;
+		if (write_memory_bus_v1_batch(target, address, size,
+					(next_address - address) / size, count, buffer,
+					&sbcs, &busy) != ERROR_OK)
+			return ERROR_FAIL;
 
+		/* The last write may still be in progress. */
 		if (read_sbcs_nonbusy(target, &sbcs) != ERROR_OK)
 			return ERROR_FAIL;
 
 		if (get_field(sbcs, DMI_SBCS_SBBUSYERROR)) {
 			/* We wrote while the target was busy. Slow down and try again. */
-			dmi_write(target, DMI_SBCS, DMI_SBCS_SBBUSYERROR);
-			next_address = sb_read_address(target);
+			if (dmi_write(target, DMI_SBCS, DMI_SBCS_SBBUSYERROR) != ERROR_OK)
+				return ERROR_FAIL;
 			info->bus_master_write_delay += info->bus_master_write_delay / 10 + 1;
+			busy = true;
+		}
+
+		if (busy && !get_field(sbcs, DMI_SBCS_SBERROR)) {
+			/* The address only advances when a write completes, so it points
+			 * at the first word that didn't make it to the bus. */
+			target_addr_t resume_address = sb_read_address(target);
+			if (resume_address < next_address || resume_address > end_address) {
+				LOG_ERROR("System bus is at unexpected address 0x%" TARGET_PRIxADDR
+						" after busy (writing 0x%" TARGET_PRIxADDR "-0x%"
+						TARGET_PRIxADDR ")", resume_address, address,
+						end_address);
+				return ERROR_FAIL;
+			}
+			LOG_DEBUG("System bus write was busy; resuming at 0x%" TARGET_PRIxADDR,
+					resume_address);
+			next_address = resume_address;
 			continue;
 		}
 
@@ -2934,7 +4007,7 @@ static int write_memory_progbuf(struct target *target, target_addr_t address,
 
 		struct riscv_batch *batch = riscv_batch_alloc(
 				target,
-				32,
+				progbuf_batch_size(target),
 				info->dmi_busy_delay + info->ac_busy_delay);
 
 		/* To write another word, we put it in S1 and execute the program. */
@@ -3004,6 +4077,7 @@ static int write_memory_progbuf(struct target *target, target_addr_t address,
 			}
 		}
 
+		bool full = riscv_batch_full(batch);
 		result = batch_run(target, batch);
 		riscv_batch_free(batch);
 		if (result != ERROR_OK)
@@ -3024,7 +4098,9 @@ static int write_memory_progbuf(struct target *target, target_addr_t address,
 		info->cmderr = get_field(abstractcs, DMI_ABSTRACTCS_CMDERR);
 		if (info->cmderr == CMDERR_NONE && !dmi_busy_encountered) {
 			LOG_DEBUG("successful (partial?) memory write");
+			progbuf_batch_done(target, full, false);
 		} else if (info->cmderr == CMDERR_BUSY || dmi_busy_encountered) {
+			progbuf_batch_done(target, false, true);
 			if (info->cmderr == CMDERR_BUSY)
 				LOG_DEBUG("Memory write resulted in abstract command busy response.");
 			else if (dmi_busy_encountered)
@@ -3064,26 +4140,58 @@ error:
 	return result;
 }
 
+/* Add a write to the throughput counters shown by "riscv stats". */
+static void record_write_throughput(uint64_t *total_bytes, uint64_t *total_us,
+		const char *method, uint32_t bytes, int64_t start)
+{
+	int64_t us = riscv_stats_time_us() - start;
+	*total_bytes += bytes;
+	*total_us += us;
+	LOG_DEBUG("wrote %" PRIu32 " bytes through %s in %" PRId64 "us; %" PRIu64
+			" bytes in %" PRIu64 "us in total", bytes, method, us, *total_bytes,
+			*total_us);
+}
+
 static int write_memory(struct target *target, target_addr_t address,
 		uint32_t size, uint32_t count, const uint8_t *buffer)
 {
 	RISCV013_INFO(info);
-	if (info->progbufsize >= 2 && !riscv_prefer_sba)
-		return write_memory_progbuf(target, address, size, count, buffer);
+	RISCV_INFO(r);
+	int64_t start = riscv_stats_time_us();
+	int result;
+
+	if (info->progbufsize >= 2 && !riscv_prefer_sba &&
+			target->state != TARGET_RUNNING) {
+		result = write_memory_progbuf(target, address, size, count, buffer);
+		if (result == ERROR_OK)
+			record_write_throughput(&r->stats.progbuf_write_bytes,
+					&r->stats.progbuf_write_us, "progbuf", size * count, start);
+		return result;
+	}
 
 	if ((get_field(info->sbcs, DMI_SBCS_SBACCESS8) && size == 1) ||
 			(get_field(info->sbcs, DMI_SBCS_SBACCESS16) && size == 2) ||
 			(get_field(info->sbcs, DMI_SBCS_SBACCESS32) && size == 4) ||
 			(get_field(info->sbcs, DMI_SBCS_SBACCESS64) && size == 8) ||
 			(get_field(info->sbcs, DMI_SBCS_SBACCESS128) && size == 16)) {
-		if (get_field(info->sbcs, DMI_SBCS_SBVERSION) == 0)
+		if (get_field(info->sbcs, DMI_SBCS_SBVERSION) == 0) {
 			return write_memory_bus_v0(target, address, size, count, buffer);
-		else if (get_field(info->sbcs, DMI_SBCS_SBVERSION) == 1)
-			return write_memory_bus_v1(target, address, size, count, buffer);
+		} else if (get_field(info->sbcs, DMI_SBCS_SBVERSION) == 1) {
+			result = write_memory_bus_v1(target, address, size, count, buffer);
+			if (result == ERROR_OK)
+				record_write_throughput(&r->stats.sb_write_bytes,
+						&r->stats.sb_write_us, "system bus", size * count, start);
+			return result;
+		}
 	}
 
-	if (info->progbufsize >= 2)
-		return write_memory_progbuf(target, address, size, count, buffer);
+	if (info->progbufsize >= 2) {
+		result = write_memory_progbuf(target, address, size, count, buffer);
+		if (result == ERROR_OK)
+			record_write_throughput(&r->stats.progbuf_write_bytes,
+					&r->stats.progbuf_write_us, "progbuf", size * count, start);
+		return result;
+	}
 
 	LOG_ERROR("Don't know how to write memory on this target.");
 	return ERROR_FAIL;
@@ -3190,6 +4298,82 @@ static int riscv013_select_current_hart(struct target *target)
 	return result;
 }
 
+/* Read HALTSUM<level>, which covers the window of harts that starts at base,
+ * and descend into every group of harts that it reports as containing a halted
+ * hart. */
+static int read_halt_summary(struct target *target, unsigned level,
+		uint32_t base, uint32_t *halted, unsigned hart_count)
+{
+	static const unsigned haltsum[] = {
+		DMI_HALTSUM0, DMI_HALTSUM1, DMI_HALTSUM2, DMI_HALTSUM3
+	};
+	dm013_info_t *dm = get_dm(target);
+
+	/* The bits of hartsel above the ones this register summarizes select the
+	 * window it covers. */
+	unsigned window_shift = 5 * (level + 1);
+	if (dm->current_hartid < 0 ||
+			((uint32_t) dm->current_hartid >> window_shift) != base >> window_shift) {
+		if (dmi_write(target, DMI_DMCONTROL,
+					set_hartsel(DMI_DMCONTROL_DMACTIVE, base)) != ERROR_OK)
+			return ERROR_FAIL;
+		dm->current_hartid = base;
+	}
+
+	uint32_t summary;
+	if (dmi_read(target, &summary, haltsum[level]) != ERROR_OK)
+		return ERROR_FAIL;
+
+	uint32_t span = 1 << (5 * level);
+	for (unsigned i = 0; i < 32; i++) {
+		if (!(summary & (1U << i)))
+			continue;
+		uint32_t first = base + i * span;
+		if (first >= hart_count)
+			break;
+		if (level == 0) {
+			halted[first / 32] |= 1U << (first % 32);
+		} else if (read_halt_summary(target, level - 1, first, halted,
+					hart_count) != ERROR_OK) {
+			return ERROR_FAIL;
+		}
+	}
+	return ERROR_OK;
+}
+
+/* Tell whether a hart is halted, from the HALTSUM registers. They are read
+ * once per generation for the whole DM, which only takes a single DMI read
+ * when no hart is halted, or a few when some are, no matter how many harts
+ * there are. */
+static int riscv013_halt_summary(struct target *target, unsigned generation,
+		int hartid, bool *halted)
+{
+	RISCV013_INFO(info);
+	dm013_info_t *dm = get_dm(target);
+	if (!dm)
+		return ERROR_FAIL;
+	/* A DM with a single hart doesn't have to implement haltsum0. */
+	if (dm->hart_count <= 1)
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	if (hartid >= dm->hart_count)
+		return ERROR_FAIL;
+
+	if (!dm->halt_summary_valid || dm->halt_summary_generation != generation) {
+		dm->halt_summary_valid = false;
+		memset(dm->halt_summary, 0, sizeof(dm->halt_summary));
+		unsigned level = (info->hartsellen > 5) + (info->hartsellen > 10) +
+			(info->hartsellen > 15);
+		if (read_halt_summary(target, level, 0, dm->halt_summary,
+					dm->hart_count) != ERROR_OK)
+			return ERROR_FAIL;
+		dm->halt_summary_generation = generation;
+		dm->halt_summary_valid = true;
+	}
+
+	*halted = dm->halt_summary[hartid / 32] & (1U << (hartid % 32));
+	return ERROR_OK;
+}
+
 /* Select all harts that were prepped and that are selectable, clearing the
  * prepped flag on the harts that actually were selected. */
 static int select_prepped_harts(struct target *target, bool *use_hasel)
@@ -3310,6 +4494,135 @@ static int riscv013_resume_go(struct target *target)
 	return riscv013_step_or_resume_current_hart(target, false, use_hasel);
 }
 
+/* Halt or resume all the prepped harts in the SMP group of target, when they
+ * are spread over more than one DM. On every DM the prepped harts are
+ * selected through the hart array mask first. Then the haltreq/resumereq
+ * writes for all the DMs go out in a single JTAG queue flush, so the harts
+ * start or stop within a few scans of each other. */
+static int riscv013_smp_go(struct target *target, bool halt)
+{
+	if (!target->smp || riscv_rtos_enabled(target))
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+
+	unsigned target_count = 0;
+	for (struct target_list *tlist = target->head; tlist; tlist = tlist->next)
+		target_count++;
+
+	/* One prepped target on every DM that has any. */
+	struct target *dm_targets[target_count];
+	unsigned dm_count = 0;
+	for (struct target_list *tlist = target->head; tlist; tlist = tlist->next) {
+		struct target *t = tlist->target;
+		riscv_info_t *r = riscv_info(t);
+		if (r->smp_go != riscv013_smp_go)
+			return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+		if (!r->prepped)
+			continue;
+		dm013_info_t *dm = get_dm(t);
+		if (!dm->hasel_supported)
+			return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+		unsigned i;
+		for (i = 0; i < dm_count; i++) {
+			if (get_dm(dm_targets[i]) == dm)
+				break;
+		}
+		if (i == dm_count)
+			dm_targets[dm_count++] = t;
+	}
+	/* halt_go()/resume_go() already handle everything on one DM at once. */
+	if (dm_count < 2)
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+
+	LOG_DEBUG("%s harts on %d DMs at once", halt ? "halting" : "resuming",
+			dm_count);
+
+	for (struct target_list *tlist = target->head; tlist; tlist = tlist->next)
+		riscv_info(tlist->target)->selected = false;
+
+	uint32_t dmcontrol[dm_count];
+	for (unsigned i = 0; i < dm_count; i++) {
+		struct target *t = dm_targets[i];
+		bool use_hasel;
+		if (select_prepped_harts(t, &use_hasel) != ERROR_OK)
+			return ERROR_FAIL;
+		dmcontrol[i] = DMI_DMCONTROL_DMACTIVE |
+			(halt ? DMI_DMCONTROL_HALTREQ : DMI_DMCONTROL_RESUMEREQ);
+		if (use_hasel)
+			dmcontrol[i] |= DMI_DMCONTROL_HASEL;
+		dmcontrol[i] = set_hartsel(dmcontrol[i], riscv_info(t)->current_hartid);
+		get_dm(t)->current_hartid = riscv_info(t)->current_hartid;
+	}
+
+	struct riscv_batch *batches[dm_count];
+	size_t keys[dm_count];
+	for (unsigned i = 0; i < dm_count; i++) {
+		struct target *t = dm_targets[i];
+		batches[i] = riscv_batch_alloc(t, 3, get_info(t)->dmi_busy_delay);
+		if (!batches[i]) {
+			for (unsigned j = 0; j < i; j++)
+				riscv_batch_free(batches[j]);
+			return ERROR_FAIL;
+		}
+		riscv_batch_add_dmi_write(batches[i], DMI_DMCONTROL, dmcontrol[i]);
+		/* Only here to see whether the write went through. */
+		keys[i] = riscv_batch_add_dmi_read(batches[i], DMI_DMSTATUS);
+	}
+
+	for (unsigned i = 0; i < dm_count; i++) {
+		select_dmi(dm_targets[i]);
+		riscv_batch_queue(batches[i]);
+	}
+	int result = jtag_execute_queue();
+	for (unsigned i = 0; i < dm_count; i++) {
+		if (result == ERROR_OK) {
+			riscv_batch_finish(batches[i]);
+			unsigned status = riscv_batch_get_dmi_read_op(batches[i], keys[i]);
+			if (status == DMI_STATUS_BUSY)
+				increase_dmi_busy_delay(dm_targets[i]);
+			if (status != DMI_STATUS_SUCCESS) {
+				/* The request may not have made it, so send it again. */
+				LOG_DEBUG("DM %d: status=%d, writing dmcontrol again", i, status);
+				if (dmi_write(dm_targets[i], DMI_DMCONTROL, dmcontrol[i]) != ERROR_OK)
+					result = ERROR_FAIL;
+			}
+		}
+		riscv_batch_free(batches[i]);
+	}
+	if (result != ERROR_OK) {
+		LOG_ERROR("Failed to %s harts on %d DMs.", halt ? "halt" : "resume",
+				dm_count);
+		return ERROR_FAIL;
+	}
+
+	/* With hasel set, dmstatus reports on all the selected harts. */
+	for (unsigned i = 0; i < dm_count; i++) {
+		struct target *t = dm_targets[i];
+		uint32_t dmstatus = 0;
+		bool done = false;
+		for (size_t j = 0; j < 256 && !done; ++j) {
+			if (dmstatus_read(t, &dmstatus, true) != ERROR_OK)
+				return ERROR_FAIL;
+			done = get_field(dmstatus, halt ? DMI_DMSTATUS_ALLHALTED :
+					DMI_DMSTATUS_ALLRESUMEACK);
+		}
+
+		uint32_t clear = set_field(dmcontrol[i], DMI_DMCONTROL_HASEL, 0);
+		clear = set_field(clear, DMI_DMCONTROL_HALTREQ, 0);
+		clear = set_field(clear, DMI_DMCONTROL_RESUMEREQ, 0);
+		if (dmi_write(t, DMI_DMCONTROL, clear) != ERROR_OK)
+			return ERROR_FAIL;
+
+		if (!done) {
+			LOG_ERROR("unable to %s the selected harts on the DM of hart %d",
+					halt ? "halt" : "resume", riscv_info(t)->current_hartid);
+			LOG_ERROR("  dmstatus =0x%08x", dmstatus);
+			result = ERROR_FAIL;
+		}
+	}
+
+	return result;
+}
+
 static int riscv013_step_current_hart(struct target *target)
 {
 	return riscv013_step_or_resume_current_hart(target, true, false);
@@ -3400,6 +4713,72 @@ int riscv013_write_debug_buffer(struct target *target, unsigned index, riscv_ins
 	return ERROR_OK;
 }
 
+/* Write only the words of the program that aren't in the program buffer
+ * already, all in one batch. Programs that are reused, like the ones that
+ * access the same CSR or do the same kind of memory access, usually differ in
+ * at most one word from what was loaded before, or not at all. */
+static int riscv013_write_debug_program(struct target *target, unsigned count,
+		const riscv_insn_t *insns)
+{
+	RISCV013_INFO(info);
+	dm013_info_t *dm = get_dm(target);
+	if (!dm)
+		return ERROR_FAIL;
+	assert(count <= DIM(dm->progbuf_cache));
+
+	unsigned changed = 0;
+	for (unsigned i = 0; i < count; i++) {
+		if (dm->progbuf_cache[i] != insns[i])
+			changed++;
+	}
+	if (changed == 0) {
+		LOG_DEBUG("program of %u words is already loaded", count);
+		return ERROR_OK;
+	}
+	if (changed == 1) {
+		for (unsigned i = 0; i < count; i++) {
+			if (riscv013_write_debug_buffer(target, i, insns[i]) != ERROR_OK)
+				return ERROR_FAIL;
+		}
+		return ERROR_OK;
+	}
+
+	struct riscv_batch *batch = riscv_batch_alloc(target, changed + 2,
+			info->dmi_busy_delay);
+	if (!batch)
+		return ERROR_FAIL;
+	for (unsigned i = 0; i < count; i++) {
+		if (dm->progbuf_cache[i] != insns[i])
+			riscv_batch_add_dmi_write(batch, DMI_PROGBUF0 + i, insns[i]);
+	}
+	/* Only here to see whether the writes went through. */
+	size_t key = riscv_batch_add_dmi_read(batch, DMI_ABSTRACTCS);
+
+	int result = batch_run(target, batch);
+	unsigned status = riscv_batch_get_dmi_read_op(batch, key);
+	riscv_batch_free(batch);
+	if (result != ERROR_OK)
+		return ERROR_FAIL;
+
+	if (status == DMI_STATUS_SUCCESS) {
+		for (unsigned i = 0; i < count; i++)
+			dm->progbuf_cache[i] = insns[i];
+		return ERROR_OK;
+	}
+
+	/* We don't know which writes made it, so write everything again the slow
+	 * way. */
+	if (status == DMI_STATUS_BUSY)
+		increase_dmi_busy_delay(target);
+	LOG_DEBUG("batched program write failed (status=%d); retrying", status);
+	memset(dm->progbuf_cache, 0, sizeof(dm->progbuf_cache));
+	for (unsigned i = 0; i < count; i++) {
+		if (riscv013_write_debug_buffer(target, i, insns[i]) != ERROR_OK)
+			return ERROR_FAIL;
+	}
+	return ERROR_OK;
+}
+
 riscv_insn_t riscv013_read_debug_buffer(struct target *target, unsigned index)
 {
 	uint32_t value;
@@ -13,10 +13,14 @@
 #include "jtag/jtag.h"
 #include "target/register.h"
 #include "target/breakpoints.h"
+#include "target/image.h"
 #include "helper/time_support.h"
 #include "riscv.h"
+#include "batch.h"
+#include "debug_defines.h"
 #include "gdb_regs.h"
 #include "rtos/rtos.h"
+#include "server/server.h"
 
 /**
  * Since almost everything can be accomplish by scanning the dbus register, all
@@ -252,8 +256,26 @@ int riscv_reset_timeout_sec = DEFAULT_RESET_TIMEOUT_SEC;
 
 bool riscv_prefer_sba;
 
+/* Batch size limits for targets that haven't been initialized yet. Settable
+ * via "riscv set_batch_size" in the configuration stage. */
+static unsigned riscv_batch_size_min = RISCV_DEFAULT_BATCH_SIZE_MIN;
+static unsigned riscv_batch_size_max = RISCV_DEFAULT_BATCH_SIZE_MAX;
+
+/* Spread large program buffer reads over the halted harts of an SMP group. */
+bool riscv_parallel_read;
+
 bool riscv_enable_virtual;
 
+/* Memory-mapped register that reads as the PC of the hart while it is running,
+ * set with "riscv set_pc_sample_address". riscv_pc_sample_size is 0 when there
+ * is none. */
+static target_addr_t riscv_pc_sample_address;
+static unsigned riscv_pc_sample_size;
+
+/* File selected by "riscv delay_profile load". Delays found in it are applied
+ * whenever a target is examined. */
+static char *riscv_delay_profile_file;
+
 typedef struct {
 	uint16_t low, high;
 } range_t;
@@ -272,6 +294,7 @@ static enum {
 } resume_order;
 
 static int riscv_resume_go_all_harts(struct target *target);
+static void memory_sample_stop(void);
 
 void select_dmi_via_bscan(struct target *target)
 {
@@ -461,8 +484,13 @@ static void riscv_deinit_target(struct target *target)
 	struct target_type *tt = get_target_type(target);
 	if (tt) {
 		tt->deinit_target(target);
+		riscv_batch_free_pool(target);
+		riscv_semihosting_flush();
+		memory_sample_stop();
 		riscv_info_t *info = (riscv_info_t *) target->arch_info;
 		free(info->reg_names);
+		free(info->reg_cache_values);
+		free(info->reg_cache_valid);
 		free(info);
 	}
 	/* Free the shared structure use for most registers. */
@@ -960,6 +988,153 @@ static int old_or_new_riscv_step(
 }
 
 
+/* Each line in a delay profile file looks like this, and '#' starts a comment:
+ * <idcode> <adapter speed in kHz> <dmi_busy> <ac_busy> <bus_master_read> <bus_master_write> */
+static void riscv_delay_profile_line(char *buf, size_t size, uint32_t idcode,
+		unsigned khz, const struct riscv_delays *delays)
+{
+	snprintf(buf, size, "0x%08" PRIx32 " %u %d %d %d %d", idcode, khz,
+			delays->dmi_busy, delays->ac_busy, delays->bus_master_read,
+			delays->bus_master_write);
+}
+
+static bool riscv_delay_profile_parse(const char *line, uint32_t *idcode,
+		unsigned *khz, struct riscv_delays *delays)
+{
+	while (isspace((unsigned char)*line))
+		line++;
+	if (*line == '#')
+		return false;
+	if (sscanf(line, "%" SCNx32 " %u %d %d %d %d", idcode, khz,
+			&delays->dmi_busy, &delays->ac_busy, &delays->bus_master_read,
+			&delays->bus_master_write) != 6)
+		return false;
+	/* The delays end up in unsigned idle cycle counts. */
+	if (delays->dmi_busy < 0 || delays->ac_busy < 0 ||
+			delays->bus_master_read < 0 || delays->bus_master_write < 0) {
+		LOG_WARNING("Ignoring delay profile line with a negative delay: %.*s",
+				(int) strcspn(line, "\r\n"), line);
+		return false;
+	}
+	return true;
+}
+
+/* Look for the profile matching this target's IDCODE and the current adapter
+ * speed. */
+static int riscv_delay_profile_find(struct target *target, const char *path,
+		struct riscv_delays *delays, bool *found)
+{
+	*found = false;
+
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		LOG_ERROR("Couldn't open delay profile %s: %s", path, strerror(errno));
+		return ERROR_FAIL;
+	}
+
+	char line[256];
+	while (fgets(line, sizeof(line), file)) {
+		uint32_t idcode;
+		unsigned khz;
+		struct riscv_delays d;
+		if (riscv_delay_profile_parse(line, &idcode, &khz, &d) &&
+				idcode == target->tap->idcode && khz == jtag_get_speed_khz()) {
+			*delays = d;
+			*found = true;
+			break;
+		}
+	}
+
+	fclose(file);
+	return ERROR_OK;
+}
+
+static int riscv_delay_profile_apply(struct target *target)
+{
+	RISCV_INFO(r);
+	if (!riscv_delay_profile_file || !r->set_delays)
+		return ERROR_OK;
+
+	struct riscv_delays delays;
+	bool found;
+	if (riscv_delay_profile_find(target, riscv_delay_profile_file, &delays,
+				&found) != ERROR_OK)
+		return ERROR_FAIL;
+	if (!found) {
+		LOG_DEBUG("No delay profile for idcode 0x%08" PRIx32 " at %u kHz in %s",
+				target->tap->idcode, jtag_get_speed_khz(), riscv_delay_profile_file);
+		return ERROR_OK;
+	}
+
+	LOG_INFO("Using delay profile from %s: dmi_busy_delay=%d, ac_busy_delay=%d, "
+			"bus_master_read_delay=%d, bus_master_write_delay=%d",
+			riscv_delay_profile_file, delays.dmi_busy, delays.ac_busy,
+			delays.bus_master_read, delays.bus_master_write);
+	r->set_delays(target, &delays);
+	return ERROR_OK;
+}
+
+/* Store the current delays of this target in path, replacing any profile for
+ * the same IDCODE and adapter speed. */
+static int riscv_delay_profile_save(struct target *target, const char *path)
+{
+	RISCV_INFO(r);
+	struct riscv_delays delays;
+	r->get_delays(target, &delays);
+
+	uint32_t this_idcode = target->tap->idcode;
+	unsigned this_khz = jtag_get_speed_khz();
+
+	/* Keep every other line of the existing file. */
+	char *contents = NULL;
+	size_t length = 0;
+	FILE *file = fopen(path, "r");
+	if (file) {
+		char line[256];
+		while (fgets(line, sizeof(line), file)) {
+			uint32_t idcode;
+			unsigned khz;
+			struct riscv_delays d;
+			if (riscv_delay_profile_parse(line, &idcode, &khz, &d) &&
+					idcode == this_idcode && khz == this_khz)
+				continue;
+			size_t line_length = strlen(line);
+			char *new_contents = realloc(contents, length + line_length + 1);
+			if (!new_contents) {
+				free(contents);
+				fclose(file);
+				return ERROR_FAIL;
+			}
+			contents = new_contents;
+			memcpy(contents + length, line, line_length + 1);
+			length += line_length;
+		}
+		fclose(file);
+	}
+
+	file = fopen(path, "w");
+	if (!file) {
+		LOG_ERROR("Couldn't open delay profile %s for writing: %s", path,
+				strerror(errno));
+		free(contents);
+		return ERROR_FAIL;
+	}
+
+	char line[256];
+	riscv_delay_profile_line(line, sizeof(line), this_idcode, this_khz, &delays);
+	int result = ERROR_OK;
+	if ((contents && fputs(contents, file) == EOF) ||
+			fprintf(file, "%s\n", line) < 0)
+		result = ERROR_FAIL;
+	if (fclose(file) != 0)
+		result = ERROR_FAIL;
+	free(contents);
+
+	if (result != ERROR_OK)
+		LOG_ERROR("Failed to write delay profile %s", path);
+	return result;
+}
+
 static int riscv_examine(struct target *target)
 {
 	LOG_DEBUG("riscv_examine()");
@@ -984,6 +1159,9 @@ static int riscv_examine(struct target *target)
 	if (result != ERROR_OK)
 		return result;
 
+	/* A missing profile shouldn't keep us from talking to the target. */
+	riscv_delay_profile_apply(target);
+
 	return tt->examine(target);
 }
 
@@ -1086,7 +1264,26 @@ int riscv_halt(struct target *target)
 				result = ERROR_FAIL;
 		}
 
-		for (struct target_list *tlist = target->head; tlist; tlist = tlist->next) {
+		int go = ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+		if (r->smp_go)
+			go = r->smp_go(target, true);
+		if (go == ERROR_OK) {
+			for (struct target_list *tlist = target->head; tlist; tlist = tlist->next) {
+				struct target *t = tlist->target;
+				if (!riscv_info(t)->selected)
+					continue;
+				riscv_invalidate_register_cache(t);
+				t->state = TARGET_HALTED;
+				if (t->debug_reason == DBG_REASON_NOTHALTED)
+					t->debug_reason = DBG_REASON_DBGRQ;
+			}
+		} else if (go != ERROR_TARGET_RESOURCE_NOT_AVAILABLE) {
+			result = ERROR_FAIL;
+		}
+
+		for (struct target_list *tlist = target->head;
+				tlist && go == ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+				tlist = tlist->next) {
 			struct target *t = tlist->target;
 			riscv_info_t *i = riscv_info(t);
 			if (i->prepped) {
@@ -1126,7 +1323,7 @@ static int riscv_assert_reset(struct target *target)
 {
 	LOG_DEBUG("[%d]", target->coreid);
 	struct target_type *tt = get_target_type(target);
-	riscv_invalidate_register_cache(target);
+	riscv_flush_register_cache(target);
 	return tt->assert_reset(target);
 }
 
@@ -1244,7 +1441,7 @@ static int resume_go(struct target *target, int current,
 
 static int resume_finish(struct target *target)
 {
-	register_cache_invalidate(target->reg_cache);
+	riscv_invalidate_register_cache(target);
 
 	target->state = TARGET_RUNNING;
 	target->debug_reason = DBG_REASON_NOTHALTED;
@@ -1268,7 +1465,23 @@ int riscv_resume(
 				result = ERROR_FAIL;
 		}
 
-		for (struct target_list *tlist = target->head; tlist; tlist = tlist->next) {
+		riscv_info_t *r = riscv_info(target);
+		int go = ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+		if (r->smp_go)
+			go = r->smp_go(target, false);
+		if (go == ERROR_OK) {
+			for (struct target_list *tlist = target->head; tlist; tlist = tlist->next) {
+				struct target *t = tlist->target;
+				if (riscv_info(t)->selected)
+					riscv_invalidate_register_cache(t);
+			}
+		} else if (go != ERROR_TARGET_RESOURCE_NOT_AVAILABLE) {
+			result = ERROR_FAIL;
+		}
+
+		for (struct target_list *tlist = target->head;
+				tlist && go == ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+				tlist = tlist->next) {
 			struct target *t = tlist->target;
 			riscv_info_t *i = riscv_info(t);
 			if (i->prepped) {
@@ -1327,6 +1540,48 @@ static int riscv_write_memory(struct target *target, target_addr_t address,
 	return tt->write_memory(target, address, size, count, buffer);
 }
 
+/* Fetch as many of the first count registers as possible at once, instead of
+ * reading them one at a time. Whatever is still invalid afterwards is read
+ * the slow way by the caller. */
+static void riscv_read_registers_at_once(struct target *target, unsigned count)
+{
+	RISCV_INFO(r);
+	unsigned numbers[GDB_REGNO_FPR31 + 1];
+	uint64_t values[GDB_REGNO_FPR31 + 1];
+	bool read[GDB_REGNO_FPR31 + 1];
+	unsigned n = 0;
+
+	if (!r->read_registers || target->state != TARGET_HALTED)
+		return;
+
+	for (unsigned number = GDB_REGNO_ZERO + 1;
+			number < count && number <= GDB_REGNO_FPR31; number++) {
+		struct reg *reg = &target->reg_cache->reg_list[number];
+		if (number == GDB_REGNO_PC || !reg->exist || reg->valid)
+			continue;
+		/* Those are handled by riscv_get_register_on_hart(). */
+		if (number > GDB_REGNO_XPR15 && number <= GDB_REGNO_XPR31 &&
+				riscv_supports_extension(target, riscv_current_hartid(target), 'E'))
+			continue;
+		numbers[n++] = number;
+	}
+	if (n < 2)
+		return;
+
+	if (r->read_registers(target, n, numbers, values, read) != ERROR_OK) {
+		LOG_DEBUG("Couldn't read registers at once; reading them one by one.");
+		return;
+	}
+
+	for (unsigned i = 0; i < n; i++) {
+		if (!read[i])
+			continue;
+		struct reg *reg = &target->reg_cache->reg_list[numbers[i]];
+		buf_set_u64(reg->value, 0, reg->size, values[i]);
+		reg->valid = true;
+	}
+}
+
 static int riscv_get_gdb_reg_list_internal(struct target *target,
 		struct reg **reg_list[], int *reg_list_size,
 		enum target_register_class reg_class, bool read)
@@ -1359,6 +1614,9 @@ static int riscv_get_gdb_reg_list_internal(struct target *target,
 	if (!*reg_list)
 		return ERROR_FAIL;
 
+	if (read)
+		riscv_read_registers_at_once(target, *reg_list_size);
+
 	for (int i = 0; i < *reg_list_size; i++) {
 		assert(!target->reg_cache->reg_list[i].valid ||
 				target->reg_cache->reg_list[i].size > 0);
@@ -1398,10 +1656,10 @@ static int riscv_arch_state(struct target *target)
 }
 
 /* Algorithm must end with a software breakpoint instruction. */
-static int riscv_run_algorithm(struct target *target, int num_mem_params,
+static int riscv_start_algorithm(struct target *target, int num_mem_params,
 		struct mem_param *mem_params, int num_reg_params,
 		struct reg_param *reg_params, target_addr_t entry_point,
-		target_addr_t exit_point, int timeout_ms, void *arch_info)
+		target_addr_t exit_point, void *arch_info)
 {
 	riscv_info_t *info = (riscv_info_t *) target->arch_info;
 
@@ -1419,9 +1677,8 @@ static int riscv_run_algorithm(struct target *target, int num_mem_params,
 	struct reg *reg_pc = register_get_by_name(target->reg_cache, "pc", 1);
 	if (!reg_pc || reg_pc->type->get(reg_pc) != ERROR_OK)
 		return ERROR_FAIL;
-	uint64_t saved_pc = buf_get_u64(reg_pc->value, 0, reg_pc->size);
+	info->algorithm_saved_pc = buf_get_u64(reg_pc->value, 0, reg_pc->size);
 
-	uint64_t saved_regs[32];
 	for (int i = 0; i < num_reg_params; i++) {
 		LOG_DEBUG("save %s", reg_params[i].reg_name);
 		struct reg *r = register_get_by_name(target->reg_cache, reg_params[i].reg_name, 0);
@@ -1443,7 +1700,7 @@ static int riscv_run_algorithm(struct target *target, int num_mem_params,
 
 		if (r->type->get(r) != ERROR_OK)
 			return ERROR_FAIL;
-		saved_regs[r->number] = buf_get_u64(r->value, 0, r->size);
+		info->algorithm_saved_regs[r->number] = buf_get_u64(r->value, 0, r->size);
 
 		if (reg_params[i].direction == PARAM_OUT || reg_params[i].direction == PARAM_IN_OUT) {
 			if (r->type->set(r, reg_params[i].value) != ERROR_OK)
@@ -1453,7 +1710,6 @@ static int riscv_run_algorithm(struct target *target, int num_mem_params,
 
 
 	/* Disable Interrupts before attempting to run the algorithm. */
-	uint64_t current_mstatus;
 	uint8_t mstatus_bytes[8];
 
 	LOG_DEBUG("Disabling Interrupts");
@@ -1465,10 +1721,11 @@ static int riscv_run_algorithm(struct target *target, int num_mem_params,
 	}
 
 	reg_mstatus->type->get(reg_mstatus);
-	current_mstatus = buf_get_u64(reg_mstatus->value, 0, reg_mstatus->size);
+	info->algorithm_saved_mstatus = buf_get_u64(reg_mstatus->value, 0,
+			reg_mstatus->size);
 	uint64_t ie_mask = MSTATUS_MIE | MSTATUS_HIE | MSTATUS_SIE | MSTATUS_UIE;
-	buf_set_u64(mstatus_bytes, 0, info->xlen[0], set_field(current_mstatus,
-				ie_mask, 0));
+	buf_set_u64(mstatus_bytes, 0, info->xlen[0],
+			set_field(info->algorithm_saved_mstatus, ie_mask, 0));
 
 	reg_mstatus->type->set(reg_mstatus, mstatus_bytes);
 
@@ -1477,6 +1734,16 @@ static int riscv_run_algorithm(struct target *target, int num_mem_params,
 	if (riscv_resume(target, 0, entry_point, 0, 0) != ERROR_OK)
 		return ERROR_FAIL;
 
+	return ERROR_OK;
+}
+
+static int riscv_wait_algorithm(struct target *target, int num_mem_params,
+		struct mem_param *mem_params, int num_reg_params,
+		struct reg_param *reg_params, target_addr_t exit_point,
+		int timeout_ms, void *arch_info)
+{
+	riscv_info_t *info = (riscv_info_t *) target->arch_info;
+
 	int64_t start = timeval_ms();
 	while (target->state != TARGET_HALTED) {
 		LOG_DEBUG("poll()");
@@ -1501,7 +1768,8 @@ static int riscv_run_algorithm(struct target *target, int num_mem_params,
 			return result;
 	}
 
-	if (reg_pc->type->get(reg_pc) != ERROR_OK)
+	struct reg *reg_pc = register_get_by_name(target->reg_cache, "pc", 1);
+	if (!reg_pc || reg_pc->type->get(reg_pc) != ERROR_OK)
 		return ERROR_FAIL;
 	uint64_t final_pc = buf_get_u64(reg_pc->value, 0, reg_pc->size);
 	if (exit_point && final_pc != exit_point) {
@@ -1512,26 +1780,36 @@ static int riscv_run_algorithm(struct target *target, int num_mem_params,
 
 	/* Restore Interrupts */
 	LOG_DEBUG("Restoring Interrupts");
-	buf_set_u64(mstatus_bytes, 0, info->xlen[0], current_mstatus);
+	struct reg *reg_mstatus = register_get_by_name(target->reg_cache,
+			"mstatus", 1);
+	if (!reg_mstatus) {
+		LOG_ERROR("Couldn't find mstatus!");
+		return ERROR_FAIL;
+	}
+	uint8_t mstatus_bytes[8];
+	buf_set_u64(mstatus_bytes, 0, info->xlen[0], info->algorithm_saved_mstatus);
 	reg_mstatus->type->set(reg_mstatus, mstatus_bytes);
 
 	/* Restore registers */
 	uint8_t buf[8];
-	buf_set_u64(buf, 0, info->xlen[0], saved_pc);
+	buf_set_u64(buf, 0, info->xlen[0], info->algorithm_saved_pc);
 	if (reg_pc->type->set(reg_pc, buf) != ERROR_OK)
 		return ERROR_FAIL;
 
 	for (int i = 0; i < num_reg_params; i++) {
+		struct reg *r = register_get_by_name(target->reg_cache, reg_params[i].reg_name, 0);
+		if (!r) {
+			LOG_ERROR("Couldn't find register named '%s'", reg_params[i].reg_name);
+			return ERROR_FAIL;
+		}
 		if (reg_params[i].direction == PARAM_IN ||
 				reg_params[i].direction == PARAM_IN_OUT) {
-			struct reg *r = register_get_by_name(target->reg_cache, reg_params[i].reg_name, 0);
 			if (r->type->get(r) != ERROR_OK)
 				return ERROR_FAIL;
 			buf_cpy(r->value, reg_params[i].value, reg_params[i].size);
 		}
 		LOG_DEBUG("restore %s", reg_params[i].reg_name);
-		struct reg *r = register_get_by_name(target->reg_cache, reg_params[i].reg_name, 0);
-		buf_set_u64(buf, 0, info->xlen[0], saved_regs[r->number]);
+		buf_set_u64(buf, 0, info->xlen[0], info->algorithm_saved_regs[r->number]);
 		if (r->type->set(r, buf) != ERROR_OK)
 			return ERROR_FAIL;
 	}
@@ -1539,16 +1817,265 @@ static int riscv_run_algorithm(struct target *target, int num_mem_params,
 	return ERROR_OK;
 }
 
-/* Should run code on the target to perform CRC of
-memory. Not yet implemented.
-*/
+static int riscv_run_algorithm(struct target *target, int num_mem_params,
+		struct mem_param *mem_params, int num_reg_params,
+		struct reg_param *reg_params, target_addr_t entry_point,
+		target_addr_t exit_point, int timeout_ms, void *arch_info)
+{
+	int retval = riscv_start_algorithm(target, num_mem_params, mem_params,
+			num_reg_params, reg_params, entry_point, exit_point, arch_info);
+	if (retval != ERROR_OK)
+		return retval;
+
+	return riscv_wait_algorithm(target, num_mem_params, mem_params,
+			num_reg_params, reg_params, exit_point, timeout_ms, arch_info);
+}
+
+/* Multiply a and b as polynomials over GF(2), modulo the CRC-32 polynomial
+ * used by image_calculate_checksum(). */
+static uint32_t crc32_mulmod(uint32_t a, uint32_t b)
+{
+	uint32_t product = 0;
+	for (int i = 31; i >= 0; i--) {
+		product = (product << 1) ^ ((product & 0x80000000) ? 0x04c11db7 : 0);
+		if (b & (1u << i))
+			product ^= a;
+	}
+	return product;
+}
+
+/* Given the CRCs of two adjacent blocks, both computed with the initial value
+ * 0xffffffff, return the CRC of the two blocks together. */
+static uint32_t crc32_combine(uint32_t crc_a, uint32_t crc_b, uint32_t length_b)
+{
+	/* Feeding length_b zero bytes multiplies the CRC by x^(8*length_b). */
+	uint32_t shift = 1;
+	uint32_t power = 0x100;
+	for (uint32_t n = length_b; n; n >>= 1) {
+		if (n & 1)
+			shift = crc32_mulmod(shift, power);
+		power = crc32_mulmod(power, power);
+	}
+	return crc_b ^ crc32_mulmod(crc_a ^ 0xffffffff, shift);
+}
+
+static int riscv_checksum_memory_on_host(struct target *target,
+		target_addr_t address, uint32_t count, uint32_t *checksum)
+{
+	uint8_t *buffer = malloc(count);
+	if (!buffer) {
+		LOG_ERROR("Failed to allocate %d bytes.", count);
+		return ERROR_FAIL;
+	}
+	int retval = target_read_buffer(target, address, count, buffer);
+	if (retval == ERROR_OK)
+		retval = image_calculate_checksum(buffer, count, checksum);
+	free(buffer);
+	return retval;
+}
+
+static int riscv_checksum_memory_on_hart(struct target *target,
+		target_addr_t code_address, target_addr_t address, uint32_t count,
+		uint32_t *checksum)
+{
+	struct reg_param reg_params[2];
+	int xlen = riscv_xlen(target);
+
+	init_reg_param(&reg_params[0], "a0", xlen, PARAM_IN_OUT);
+	init_reg_param(&reg_params[1], "a1", xlen, PARAM_OUT);
+	buf_set_u64(reg_params[0].value, 0, xlen, address);
+	buf_set_u64(reg_params[1].value, 0, xlen, count);
+
+	/* 20 second timeout/megabyte */
+	int timeout = 20000 * (1 + (count / (1024 * 1024)));
+
+	int retval = target_run_algorithm(target, 0, NULL, 2, reg_params,
+			code_address,
+			0,	/* Leave exit point unspecified because we don't know. */
+			timeout, NULL);
+
+	if (retval == ERROR_OK)
+		*checksum = buf_get_u32(reg_params[0].value, 0, 32);
+	else
+		LOG_ERROR("error executing RISC-V CRC algorithm");
+
+	destroy_reg_param(&reg_params[0]);
+	destroy_reg_param(&reg_params[1]);
+
+	return retval;
+}
+
+/* Registers used by the SMP CRC algorithm, which are saved and restored on
+ * every hart that runs it. */
+static const char * const crc_smp_registers[] = {
+	"a0", "a1", "a2", "t0", "t1", "t2", "mstatus", "pc"
+};
+
+struct crc_smp_hart {
+	struct target *target;
+	riscv_reg_t saved[DIM(crc_smp_registers)];
+	target_addr_t address;
+	uint32_t count;
+	uint32_t checksum;
+	bool done;
+};
+
+static int crc_smp_get(struct target *target, const char *name, riscv_reg_t *value)
+{
+	struct reg *reg = register_get_by_name(target->reg_cache, name, 1);
+	if (!reg) {
+		LOG_ERROR("Couldn't find register named '%s'", name);
+		return ERROR_FAIL;
+	}
+	if (reg->type->get(reg) != ERROR_OK)
+		return ERROR_FAIL;
+	*value = buf_get_u64(reg->value, 0, reg->size);
+	return ERROR_OK;
+}
+
+static int crc_smp_set(struct target *target, const char *name, riscv_reg_t value)
+{
+	struct reg *reg = register_get_by_name(target->reg_cache, name, 1);
+	if (!reg) {
+		LOG_ERROR("Couldn't find register named '%s'", name);
+		return ERROR_FAIL;
+	}
+	uint8_t buf[8];
+	buf_set_u64(buf, 0, reg->size, value);
+	return reg->type->set(reg, buf);
+}
+
+/* Return the targets in target's SMP group that can run the SMP CRC
+ * algorithm together, or 0 if they can't. Every target in the group must be
+ * halted, because resuming one target resumes all of them. */
+static unsigned crc_smp_collect_harts(struct target *target,
+		struct crc_smp_hart *harts, unsigned max_harts)
+{
+	if (!target->smp || riscv_rtos_enabled(target))
+		return 0;
+
+	unsigned count = 0;
+	for (struct target_list *tlist = target->head; tlist; tlist = tlist->next) {
+		struct target *t = tlist->target;
+		if (count == max_harts || t->state != TARGET_HALTED ||
+				riscv_xlen(t) != riscv_xlen(target))
+			return 0;
+		harts[count].target = t;
+		count++;
+	}
+	return count;
+}
+
+/* Checksum the memory using all the harts in harts[] at the same time, each
+ * taking one slice of the range.
+ *
+ * When one hart finishes the whole SMP group is halted, either by the halt
+ * group in hardware or by riscv_openocd_poll(). Harts that are done are then
+ * parked in the algorithm's spin loop, and the group is resumed until every
+ * hart has finished. */
+static int riscv_checksum_memory_smp(struct target *target,
+		struct crc_smp_hart *harts, unsigned hart_count,
+		target_addr_t code_address, target_addr_t address, uint32_t count,
+		uint32_t *checksum)
+{
+	int retval = ERROR_OK;
+	unsigned saved_count = 0;
+
+	uint32_t slice = count / hart_count;
+	for (unsigned i = 0; i < hart_count; i++) {
+		struct crc_smp_hart *h = &harts[i];
+		h->address = address + i * slice;
+		h->count = i + 1 < hart_count ? slice : count - i * slice;
+		h->done = false;
+
+		for (unsigned r = 0; r < DIM(crc_smp_registers); r++) {
+			retval = crc_smp_get(h->target, crc_smp_registers[r], &h->saved[r]);
+			if (retval != ERROR_OK)
+				goto restore;
+		}
+		saved_count++;
+
+		LOG_DEBUG("[%d] CRC of 0x%x bytes at 0x%" TARGET_PRIxADDR,
+				h->target->coreid, h->count, h->address);
+		uint64_t ie_mask = MSTATUS_MIE | MSTATUS_HIE | MSTATUS_SIE | MSTATUS_UIE;
+		/* saved[] is in the order of crc_smp_registers[]. */
+		if (crc_smp_set(h->target, "mstatus", set_field(h->saved[6], ie_mask, 0)) != ERROR_OK ||
+				crc_smp_set(h->target, "a0", h->address) != ERROR_OK ||
+				crc_smp_set(h->target, "a1", h->count) != ERROR_OK ||
+				crc_smp_set(h->target, "a2", 0xffffffff) != ERROR_OK ||
+				crc_smp_set(h->target, "pc", code_address) != ERROR_OK) {
+			retval = ERROR_FAIL;
+			goto restore;
+		}
+	}
+
+	/* 20 second timeout/megabyte, for the biggest slice. */
+	int64_t timeout = 20000 * (1 + ((count - (hart_count - 1) * slice) / (1024 * 1024)));
+	int64_t start = timeval_ms();
+	unsigned done_count = 0;
+	while (done_count < hart_count) {
+		retval = riscv_resume(target, 1, 0, 0, 0);
+		if (retval != ERROR_OK)
+			goto restore;
+
+		while (target->state != TARGET_HALTED) {
+			if (timeval_ms() - start > timeout) {
+				LOG_ERROR("SMP CRC algorithm timed out after %" PRId64 " ms.",
+						timeout);
+				riscv_halt(target);
+				retval = ERROR_TARGET_TIMEOUT;
+				goto restore;
+			}
+			retval = old_or_new_riscv_poll(target);
+			if (retval != ERROR_OK)
+				goto restore;
+		}
+
+		for (unsigned i = 0; i < hart_count; i++) {
+			struct crc_smp_hart *h = &harts[i];
+			if (h->done)
+				continue;
+			riscv_reg_t remaining, crc;
+			if (crc_smp_get(h->target, "a1", &remaining) != ERROR_OK ||
+					crc_smp_get(h->target, "a2", &crc) != ERROR_OK) {
+				retval = ERROR_FAIL;
+				goto restore;
+			}
+			if (remaining != 0)
+				continue;
+			h->checksum = crc;
+			h->done = true;
+			done_count++;
+			LOG_DEBUG("[%d] CRC done: 0x%08x", h->target->coreid, h->checksum);
+			/* Park it while the others finish. */
+			if (crc_smp_set(h->target, "pc", code_address + 4) != ERROR_OK) {
+				retval = ERROR_FAIL;
+				goto restore;
+			}
+		}
+	}
+
+	*checksum = harts[0].checksum;
+	for (unsigned i = 1; i < hart_count; i++)
+		*checksum = crc32_combine(*checksum, harts[i].checksum, harts[i].count);
+
+restore:
+	for (unsigned i = 0; i < saved_count; i++) {
+		struct crc_smp_hart *h = &harts[i];
+		for (unsigned r = 0; r < DIM(crc_smp_registers); r++) {
+			if (crc_smp_set(h->target, crc_smp_registers[r], h->saved[r]) != ERROR_OK)
+				retval = ERROR_FAIL;
+		}
+	}
+
+	return retval;
+}
 
 static int riscv_checksum_memory(struct target *target,
 		target_addr_t address, uint32_t count,
 		uint32_t *checksum)
 {
 	struct working_area *crc_algorithm;
-	struct reg_param reg_params[2];
 	int retval;
 
 	LOG_DEBUG("address=0x%" TARGET_PRIxADDR "; count=0x%x", address, count);
@@ -1559,17 +2086,30 @@ static int riscv_checksum_memory(struct target *target,
 	static const uint8_t riscv64_crc_code[] = {
 #include "../../contrib/loaders/checksum/riscv64_crc.inc"
 	};
+	static const uint8_t riscv32_crc_smp_code[] = {
+#include "../../contrib/loaders/checksum/riscv32_crc_smp.inc"
+	};
+	static const uint8_t riscv64_crc_smp_code[] = {
+#include "../../contrib/loaders/checksum/riscv64_crc_smp.inc"
+	};
 
 	static const uint8_t *crc_code;
 
+	struct crc_smp_hart harts[RISCV_MAX_HARTS];
+	unsigned hart_count = crc_smp_collect_harts(target, harts, DIM(harts));
+	if (hart_count < 2 || count < hart_count * sizeof(riscv64_crc_smp_code) * 4)
+		hart_count = 0;
+
 	int xlen = riscv_xlen(target);
 	unsigned crc_code_size;
 	if (xlen == 32) {
-		crc_code = riscv32_crc_code;
-		crc_code_size = sizeof(riscv32_crc_code);
+		crc_code = hart_count ? riscv32_crc_smp_code : riscv32_crc_code;
+		crc_code_size = hart_count ? sizeof(riscv32_crc_smp_code) :
+			sizeof(riscv32_crc_code);
 	} else {
-		crc_code = riscv64_crc_code;
-		crc_code_size = sizeof(riscv64_crc_code);
+		crc_code = hart_count ? riscv64_crc_smp_code : riscv64_crc_code;
+		crc_code_size = hart_count ? sizeof(riscv64_crc_smp_code) :
+			sizeof(riscv64_crc_code);
 	}
 
 	if (count < crc_code_size * 4) {
@@ -1583,13 +2123,23 @@ static int riscv_checksum_memory(struct target *target,
 	if (retval != ERROR_OK)
 		return retval;
 
-	if (crc_algorithm->address + crc_algorithm->size > address &&
-			crc_algorithm->address < address + count) {
-		/* Region to checksum overlaps with the work area we've been assigned.
-		 * Bail. (Would be better to manually checksum what we read there, and
-		 * use the algorithm for the rest.) */
-		target_free_working_area(target, crc_algorithm);
-		return ERROR_FAIL;
+	/* Split the region into the part before the work area, the part that
+	 * overlaps it, and the part after it. The overlapping part is read
+	 * before we overwrite it with the algorithm, and checksummed here. */
+	target_addr_t end = address + count;
+	target_addr_t overlap_start = MIN(MAX(crc_algorithm->address, address), end);
+	target_addr_t overlap_end = MAX(MIN(crc_algorithm->address +
+				crc_algorithm->size, end), overlap_start);
+	uint32_t overlap_checksum = 0;
+	if (overlap_end > overlap_start) {
+		LOG_DEBUG("work area overlaps 0x%" TARGET_PRIxADDR "-0x%" TARGET_PRIxADDR
+				"; checksumming that part on the host", overlap_start, overlap_end);
+		retval = riscv_checksum_memory_on_host(target, overlap_start,
+				overlap_end - overlap_start, &overlap_checksum);
+		if (retval != ERROR_OK) {
+			target_free_working_area(target, crc_algorithm);
+			return retval;
+		}
 	}
 
 	retval = target_write_buffer(target, crc_algorithm->address, crc_code_size,
@@ -1601,26 +2151,42 @@ static int riscv_checksum_memory(struct target *target,
 		return retval;
 	}
 
-	init_reg_param(&reg_params[0], "a0", xlen, PARAM_IN_OUT);
-	init_reg_param(&reg_params[1], "a1", xlen, PARAM_OUT);
-	buf_set_u64(reg_params[0].value, 0, xlen, address);
-	buf_set_u64(reg_params[1].value, 0, xlen, count);
-
-	/* 20 second timeout/megabyte */
-	int timeout = 20000 * (1 + (count / (1024 * 1024)));
-
-	retval = target_run_algorithm(target, 0, NULL, 2, reg_params,
-			crc_algorithm->address,
-			0,	/* Leave exit point unspecified because we don't know. */
-			timeout, NULL);
-
-	if (retval == ERROR_OK)
-		*checksum = buf_get_u32(reg_params[0].value, 0, 32);
-	else
-		LOG_ERROR("error executing RISC-V CRC algorithm");
+	struct {
+		target_addr_t address;
+		uint32_t count;
+	} parts[] = {
+		{ address, overlap_start - address },
+		{ overlap_start, overlap_end - overlap_start },
+		{ overlap_end, end - overlap_end }
+	};
+	bool first = true;
+	for (unsigned i = 0; i < DIM(parts) && retval == ERROR_OK; i++) {
+		if (parts[i].count == 0)
+			continue;
 
-	destroy_reg_param(&reg_params[0]);
-	destroy_reg_param(&reg_params[1]);
+		uint32_t part_checksum;
+		if (i == 1)
+			part_checksum = overlap_checksum;
+		else if (parts[i].count < crc_code_size * 4)
+			retval = riscv_checksum_memory_on_host(target, parts[i].address,
+					parts[i].count, &part_checksum);
+		else if (hart_count)
+			retval = riscv_checksum_memory_smp(target, harts, hart_count,
+					crc_algorithm->address, parts[i].address, parts[i].count,
+					&part_checksum);
+		else
+			retval = riscv_checksum_memory_on_hart(target,
+					crc_algorithm->address, parts[i].address, parts[i].count,
+					&part_checksum);
+
+		if (retval != ERROR_OK)
+			break;
+		if (first)
+			*checksum = part_checksum;
+		else
+			*checksum = crc32_combine(*checksum, part_checksum, parts[i].count);
+		first = false;
+	}
 
 	target_free_working_area(target, crc_algorithm);
 
@@ -1686,15 +2252,36 @@ int set_debug_reason(struct target *target, int hartid)
 	return ERROR_OK;
 }
 
+/* Like riscv_poll_hart(), but first check the halt summary, if the target
+ * has one. Harts whose state didn't change then don't cost any DMI accesses
+ * of their own. */
+static enum riscv_poll_hart riscv_poll_hart_summary(struct target *target,
+		int hartid, unsigned generation)
+{
+	RISCV_INFO(r);
+	bool halted;
+	if (r->halt_summary &&
+			r->halt_summary(target, generation, hartid, &halted) == ERROR_OK &&
+			((halted && target->state == TARGET_HALTED) ||
+			 (!halted && target->state == TARGET_RUNNING)))
+		return RPH_NO_CHANGE;
+	return riscv_poll_hart(target, hartid);
+}
+
 /*** OpenOCD Interface ***/
 int riscv_openocd_poll(struct target *target)
 {
+	/* Identifies this poll, so that halt summaries are read only once. */
+	static unsigned poll_generation;
+	poll_generation++;
+
 	LOG_DEBUG("polling all harts");
 	int halted_hart = -1;
 	if (riscv_rtos_enabled(target)) {
 		/* Check every hart for an event. */
 		for (int i = 0; i < riscv_count_harts(target); ++i) {
-			enum riscv_poll_hart out = riscv_poll_hart(target, i);
+			enum riscv_poll_hart out = riscv_poll_hart_summary(target, i,
+					poll_generation);
 			switch (out) {
 			case RPH_NO_CHANGE:
 			case RPH_DISCOVERED_RUNNING:
@@ -1730,14 +2317,20 @@ int riscv_openocd_poll(struct target *target)
 
 	} else if (target->smp) {
 		bool halt_discovered = false;
-		bool newly_halted[128] = {0};
+		unsigned target_count = 0;
+		for (struct target_list *list = target->head; list != NULL;
+				list = list->next)
+			target_count++;
+		bool *newly_halted = calloc(target_count, sizeof(*newly_halted));
+		if (!newly_halted)
+			return ERROR_FAIL;
 		unsigned i = 0;
 		for (struct target_list *list = target->head; list != NULL;
 				list = list->next, i++) {
 			struct target *t = list->target;
 			riscv_info_t *r = riscv_info(t);
-			assert(i < DIM(newly_halted));
-			enum riscv_poll_hart out = riscv_poll_hart(t, r->current_hartid);
+			enum riscv_poll_hart out = riscv_poll_hart_summary(t,
+					r->current_hartid, poll_generation);
 			switch (out) {
 				case RPH_NO_CHANGE:
 					break;
@@ -1749,10 +2342,13 @@ int riscv_openocd_poll(struct target *target)
 					halt_discovered = true;
 					newly_halted[i] = true;
 					t->state = TARGET_HALTED;
-					if (set_debug_reason(t, r->current_hartid) != ERROR_OK)
+					if (set_debug_reason(t, r->current_hartid) != ERROR_OK) {
+						free(newly_halted);
 						return ERROR_FAIL;
+					}
 					break;
 				case RPH_ERROR:
+					free(newly_halted);
 					return ERROR_FAIL;
 			}
 		}
@@ -1769,6 +2365,7 @@ int riscv_openocd_poll(struct target *target)
 			LOG_DEBUG("Halt other targets in this SMP group.");
 			riscv_halt(target);
 		}
+		free(newly_halted);
 		return ERROR_OK;
 
 	} else {
@@ -1814,7 +2411,7 @@ int riscv_openocd_step(
 		return out;
 	}
 
-	register_cache_invalidate(target->reg_cache);
+	riscv_invalidate_register_cache(target);
 	target->state = TARGET_RUNNING;
 	target_call_event_callbacks(target, TARGET_EVENT_RESUMED);
 	target->state = TARGET_HALTED;
@@ -1886,17 +2483,331 @@ COMMAND_HANDLER(riscv_set_prefer_sba)
 	return ERROR_OK;
 }
 
-COMMAND_HANDLER(riscv_set_enable_virtual)
+COMMAND_HANDLER(riscv_set_batch_size)
 {
-	if (CMD_ARGC != 1) {
-		LOG_ERROR("Command takes exactly 1 parameter");
+	struct target *target = get_current_target(CMD_CTX);
+	/* Before init the target has no riscv_info_t yet. */
+	riscv_info_t *r = target->arch_info;
+
+	if (CMD_ARGC == 0) {
+		if (r)
+			command_print(CMD_CTX, "%u %u (currently %u)", r->batch_size_min,
+					r->batch_size_max, r->batch_size);
+		else
+			command_print(CMD_CTX, "%u %u", riscv_batch_size_min,
+					riscv_batch_size_max);
+		return ERROR_OK;
+	}
+	if (CMD_ARGC > 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	unsigned min, max;
+	COMMAND_PARSE_NUMBER(uint, CMD_ARGV[0], min);
+	max = min;
+	if (CMD_ARGC == 2)
+		COMMAND_PARSE_NUMBER(uint, CMD_ARGV[1], max);
+	if (min < 1 || max < min) {
+		LOG_ERROR("The batch size limits must satisfy 1 <= min <= max.");
 		return ERROR_COMMAND_SYNTAX_ERROR;
 	}
-	COMMAND_PARSE_ON_OFF(CMD_ARGV[0], riscv_enable_virtual);
+
+	if (!r) {
+		riscv_batch_size_min = min;
+		riscv_batch_size_max = max;
+		return ERROR_OK;
+	}
+	r->batch_size_min = min;
+	r->batch_size_max = max;
+	r->batch_size = MIN(MAX(r->batch_size, min), max);
 	return ERROR_OK;
 }
 
-void parse_error(const char *string, char c, unsigned position)
+COMMAND_HANDLER(riscv_set_parallel_read)
+{
+	if (CMD_ARGC != 1) {
+		LOG_ERROR("Command takes exactly 1 parameter");
+		return ERROR_COMMAND_SYNTAX_ERROR;
+	}
+	COMMAND_PARSE_ON_OFF(CMD_ARGV[0], riscv_parallel_read);
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(riscv_set_semihosting_buffer)
+{
+	if (CMD_ARGC != 1) {
+		LOG_ERROR("Command takes exactly 1 parameter");
+		return ERROR_COMMAND_SYNTAX_ERROR;
+	}
+	if (!strcmp(CMD_ARGV[0], "off")) {
+		riscv_semihosting_buffer_size = 0;
+	} else {
+		unsigned size;
+		COMMAND_PARSE_NUMBER(uint, CMD_ARGV[0], size);
+		riscv_semihosting_buffer_size = size;
+	}
+	riscv_semihosting_flush();
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(riscv_set_pc_sample_address)
+{
+	if (CMD_ARGC < 1 || CMD_ARGC > 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	if (CMD_ARGC == 1 && !strcmp(CMD_ARGV[0], "off")) {
+		riscv_pc_sample_size = 0;
+		return ERROR_OK;
+	}
+
+	target_addr_t address;
+	unsigned size = 4;
+	COMMAND_PARSE_ADDRESS(CMD_ARGV[0], address);
+	if (CMD_ARGC == 2)
+		COMMAND_PARSE_NUMBER(uint, CMD_ARGV[1], size);
+	if (size != 4 && size != 8) {
+		LOG_ERROR("Size must be 4 or 8.");
+		return ERROR_COMMAND_SYNTAX_ERROR;
+	}
+	riscv_pc_sample_address = address;
+	riscv_pc_sample_size = size;
+	return ERROR_OK;
+}
+
+/* State of "riscv memory_sample", shared by all targets. */
+static struct {
+	bool running;
+	unsigned interval_ms;
+	FILE *file;
+	/* Port of the service that streams the samples, if any. */
+	char *port;
+	struct connection *connection;
+} memory_sample;
+
+/* One line per sample set: time, target, then one value per address. */
+#define MEMORY_SAMPLE_LINE_MAX	(64 + RISCV_SAMPLE_MAX * 20)
+
+static void memory_sample_output(const char *line, size_t length)
+{
+	if (memory_sample.file)
+		fwrite(line, 1, length, memory_sample.file);
+	if (memory_sample.connection &&
+			connection_write(memory_sample.connection, line, length) != (int)length) {
+		LOG_WARNING("Lost the memory sample connection.");
+		memory_sample.connection = NULL;
+	}
+}
+
+static void memory_sample_header(struct target *target)
+{
+	RISCV_INFO(r);
+	char line[MEMORY_SAMPLE_LINE_MAX];
+	int length = snprintf(line, sizeof(line), "# time_us %s", target_name(target));
+	for (unsigned i = 0; i < r->sample_config.count; i++)
+		length += snprintf(line + length, sizeof(line) - length,
+				" 0x%" TARGET_PRIxADDR "/%u", r->sample_config.address[i],
+				r->sample_config.size[i]);
+	length += snprintf(line + length, sizeof(line) - length, "\n");
+	memory_sample_output(line, length);
+}
+
+static bool memory_sample_target(struct target *target)
+{
+	if (strcmp(target_type_name(target), "riscv") || !target_was_examined(target))
+		return false;
+	RISCV_INFO(r);
+	return r->sample_config.count > 0 && r->sample_memory_set;
+}
+
+/* Read one sample set of every target. This is bounded to a single batch per
+ * target, and a tick that comes late is not made up for. */
+static int memory_sample_timer(void *priv)
+{
+	for (struct target *target = all_targets; target; target = target->next) {
+		if (!memory_sample_target(target))
+			continue;
+		RISCV_INFO(r);
+		riscv_sample_config_t *config = &r->sample_config;
+		uint64_t values[RISCV_SAMPLE_MAX];
+		int64_t now = riscv_stats_time_us();
+		int result = r->sample_memory_set(target, config, values);
+		if (result == ERROR_WAIT) {
+			config->dropped++;
+			continue;
+		}
+		if (result != ERROR_OK) {
+			if (result == ERROR_TARGET_RESOURCE_NOT_AVAILABLE)
+				LOG_ERROR("%s can't sample these addresses over the system bus.",
+						target_name(target));
+			else
+				LOG_ERROR("Failed to sample memory of %s.", target_name(target));
+			config->count = 0;
+			continue;
+		}
+		config->taken++;
+
+		char line[MEMORY_SAMPLE_LINE_MAX];
+		int length = snprintf(line, sizeof(line), "%" PRId64 " %s", now,
+				target_name(target));
+		for (unsigned i = 0; i < config->count; i++)
+			length += snprintf(line + length, sizeof(line) - length,
+					" 0x%0*" PRIx64, 2 * config->size[i], values[i]);
+		length += snprintf(line + length, sizeof(line) - length, "\n");
+		memory_sample_output(line, length);
+	}
+	return ERROR_OK;
+}
+
+static int memory_sample_new_connection(struct connection *connection)
+{
+	memory_sample.connection = connection;
+	for (struct target *target = all_targets; target; target = target->next)
+		if (memory_sample_target(target))
+			memory_sample_header(target);
+	return ERROR_OK;
+}
+
+static int memory_sample_input(struct connection *connection)
+{
+	/* Nothing is expected from the client. */
+	char buffer[64];
+	int length = connection_read(connection, buffer, sizeof(buffer));
+	if (length <= 0)
+		return ERROR_SERVER_REMOTE_CLOSED;
+	return ERROR_OK;
+}
+
+static int memory_sample_connection_closed(struct connection *connection)
+{
+	if (memory_sample.connection == connection)
+		memory_sample.connection = NULL;
+	return ERROR_OK;
+}
+
+static void memory_sample_stop(void)
+{
+	if (!memory_sample.running)
+		return;
+	target_unregister_timer_callback(memory_sample_timer, NULL);
+	if (memory_sample.file) {
+		fclose(memory_sample.file);
+		memory_sample.file = NULL;
+	}
+	if (memory_sample.port) {
+		remove_service("riscv_memory_sample", memory_sample.port);
+		free(memory_sample.port);
+		memory_sample.port = NULL;
+		memory_sample.connection = NULL;
+	}
+	memory_sample.running = false;
+}
+
+COMMAND_HANDLER(riscv_memory_sample)
+{
+	struct target *target = get_current_target(CMD_CTX);
+	RISCV_INFO(r);
+	riscv_sample_config_t *config = &r->sample_config;
+
+	if (CMD_ARGC == 0) {
+		for (unsigned i = 0; i < config->count; i++)
+			command_print(CMD_CTX, "0x%" TARGET_PRIxADDR " size %u",
+					config->address[i], config->size[i]);
+		command_print(CMD_CTX, "%" PRIu64 " sample sets taken, %" PRIu64 " dropped",
+				config->taken, config->dropped);
+		if (memory_sample.running)
+			command_print(CMD_CTX, "sampling every %u ms", memory_sample.interval_ms);
+		return ERROR_OK;
+	}
+
+	if (!strcmp(CMD_ARGV[0], "add")) {
+		if (CMD_ARGC < 2 || CMD_ARGC > 3)
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		if (config->count == RISCV_SAMPLE_MAX) {
+			LOG_ERROR("Only %d addresses can be sampled.", RISCV_SAMPLE_MAX);
+			return ERROR_FAIL;
+		}
+		target_addr_t address;
+		unsigned size = 4;
+		COMMAND_PARSE_ADDRESS(CMD_ARGV[1], address);
+		if (CMD_ARGC == 3)
+			COMMAND_PARSE_NUMBER(uint, CMD_ARGV[2], size);
+		if (size != 1 && size != 2 && size != 4 && size != 8) {
+			LOG_ERROR("Size must be 1, 2, 4 or 8.");
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		}
+		if (address % size) {
+			LOG_ERROR("Address must be aligned to the size.");
+			return ERROR_COMMAND_ARGUMENT_INVALID;
+		}
+		config->address[config->count] = address;
+		config->size[config->count] = size;
+		config->count++;
+		return ERROR_OK;
+	}
+
+	if (!strcmp(CMD_ARGV[0], "clear")) {
+		if (CMD_ARGC != 1)
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		config->count = 0;
+		config->taken = 0;
+		config->dropped = 0;
+		return ERROR_OK;
+	}
+
+	if (!strcmp(CMD_ARGV[0], "stop")) {
+		if (CMD_ARGC != 1)
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		memory_sample_stop();
+		return ERROR_OK;
+	}
+
+	if (strcmp(CMD_ARGV[0], "start") || CMD_ARGC != 4)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	unsigned interval_ms;
+	COMMAND_PARSE_NUMBER(uint, CMD_ARGV[1], interval_ms);
+	if (interval_ms == 0) {
+		LOG_ERROR("The interval must be at least 1 ms.");
+		return ERROR_COMMAND_ARGUMENT_INVALID;
+	}
+	bool to_file = !strcmp(CMD_ARGV[2], "file");
+	if (!to_file && strcmp(CMD_ARGV[2], "port"))
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	memory_sample_stop();
+	if (to_file) {
+		memory_sample.file = fopen(CMD_ARGV[3], "w");
+		if (!memory_sample.file) {
+			LOG_ERROR("Can't open %s: %s", CMD_ARGV[3], strerror(errno));
+			return ERROR_FAIL;
+		}
+		for (struct target *t = all_targets; t; t = t->next)
+			if (memory_sample_target(t))
+				memory_sample_header(t);
+	} else {
+		if (add_service("riscv_memory_sample", CMD_ARGV[3], 1,
+				memory_sample_new_connection, memory_sample_input,
+				memory_sample_connection_closed, NULL) != ERROR_OK)
+			return ERROR_FAIL;
+		memory_sample.port = strdup(CMD_ARGV[3]);
+	}
+
+	memory_sample.interval_ms = interval_ms;
+	memory_sample.running = true;
+	return target_register_timer_callback(memory_sample_timer, interval_ms,
+			TARGET_TIMER_TYPE_PERIODIC, NULL);
+}
+
+COMMAND_HANDLER(riscv_set_enable_virtual)
+{
+	if (CMD_ARGC != 1) {
+		LOG_ERROR("Command takes exactly 1 parameter");
+		return ERROR_COMMAND_SYNTAX_ERROR;
+	}
+	COMMAND_PARSE_ON_OFF(CMD_ARGV[0], riscv_enable_virtual);
+	return ERROR_OK;
+}
+
+void parse_error(const char *string, char c, unsigned position)
 {
 	char buf[position+2];
 	for (unsigned i = 0; i < position; i++)
@@ -2215,6 +3126,440 @@ COMMAND_HANDLER(riscv_use_bscan_tunnel)
 	return ERROR_OK;
 }
 
+COMMAND_HANDLER(riscv_delay_profile)
+{
+	struct target *target = get_current_target(CMD_CTX);
+
+	if (CMD_ARGC == 2 && !strcmp(CMD_ARGV[0], "load")) {
+		free(riscv_delay_profile_file);
+		riscv_delay_profile_file = strdup(CMD_ARGV[1]);
+		if (!riscv_delay_profile_file)
+			return ERROR_FAIL;
+		/* Otherwise it is applied when the target is examined. */
+		if (target_was_examined(target))
+			return riscv_delay_profile_apply(target);
+		return ERROR_OK;
+	}
+
+	bool save = CMD_ARGC == 2 && !strcmp(CMD_ARGV[0], "save");
+	bool export = CMD_ARGC == 1 && !strcmp(CMD_ARGV[0], "export");
+	if (!save && !export)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	if (!target_was_examined(target)) {
+		LOG_ERROR("Target must be examined to know its delays.");
+		return ERROR_FAIL;
+	}
+	RISCV_INFO(r);
+	if (!r->get_delays) {
+		LOG_ERROR("Delay profiles are not supported on this target.");
+		return ERROR_FAIL;
+	}
+
+	if (save)
+		return riscv_delay_profile_save(target, CMD_ARGV[1]);
+
+	struct riscv_delays delays;
+	r->get_delays(target, &delays);
+	char line[256];
+	riscv_delay_profile_line(line, sizeof(line), target->tap->idcode,
+			jtag_get_speed_khz(), &delays);
+	command_print(CMD_CTX, "%s", line);
+	return ERROR_OK;
+}
+
+int64_t riscv_stats_time_us(void)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+void riscv_stats_add_latency(uint64_t *histogram, int64_t start_us)
+{
+	int64_t us = riscv_stats_time_us() - start_us;
+	unsigned bucket = 0;
+	while (us >= 2 && bucket < RISCV_STATS_LATENCY_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	histogram[bucket]++;
+}
+
+static void riscv_stats_print_histogram(struct command_context *cmd_ctx,
+		const char *name, const uint64_t *histogram, bool machine)
+{
+	if (machine) {
+		char line[RISCV_STATS_LATENCY_BUCKETS * 21 + 1];
+		unsigned length = 0;
+		for (unsigned i = 0; i < RISCV_STATS_LATENCY_BUCKETS; i++)
+			length += snprintf(line + length, sizeof(line) - length, "%s%" PRIu64,
+					i ? " " : "", histogram[i]);
+		command_print(cmd_ctx, "%s %s", name, line);
+		return;
+	}
+
+	command_print(cmd_ctx, "%s:", name);
+	for (unsigned i = 0; i < RISCV_STATS_LATENCY_BUCKETS; i++) {
+		if (histogram[i] == 0)
+			continue;
+		if (i == 0)
+			command_print(cmd_ctx, "  < 2us: %" PRIu64, histogram[i]);
+		else if (i == RISCV_STATS_LATENCY_BUCKETS - 1)
+			command_print(cmd_ctx, "  >= %" PRIu64 "us: %" PRIu64,
+					(uint64_t)1 << i, histogram[i]);
+		else
+			command_print(cmd_ctx, "  %" PRIu64 "-%" PRIu64 "us: %" PRIu64,
+					(uint64_t)1 << i, ((uint64_t)1 << (i + 1)) - 1, histogram[i]);
+	}
+}
+
+/* "riscv step_until address" gives up after this many steps. */
+#define RISCV_STEP_UNTIL_MAX_STEPS	10000000
+
+/* Let the current hart run count instructions, using an icount trigger to
+ * bring it back into Debug Mode. fired is false if the hart halted for some
+ * other reason first. */
+static int riscv_run_icount(struct target *target, unsigned count, bool *fired)
+{
+	RISCV_INFO(r);
+	unsigned xlen = riscv_xlen(target);
+	int hartid = r->current_hartid;
+
+	if (riscv_enumerate_triggers(target) != ERROR_OK)
+		return ERROR_FAIL;
+
+	riscv_reg_t tselect;
+	if (riscv_get_register(target, &tselect, GDB_REGNO_TSELECT) != ERROR_OK)
+		return ERROR_FAIL;
+
+	uint64_t tdata1 = set_field(0, MCONTROL_TYPE(xlen), 3) | MCONTROL_DMODE(xlen);
+	tdata1 = set_field(tdata1, CSR_ICOUNT_COUNT, count);
+	tdata1 = set_field(tdata1, CSR_ICOUNT_ACTION, MCONTROL_ACTION_DEBUG_MODE);
+	tdata1 |= CSR_ICOUNT_M;
+	if (r->misa[hartid] & (1 << ('S' - 'A')))
+		tdata1 |= CSR_ICOUNT_S;
+	if (r->misa[hartid] & (1 << ('U' - 'A')))
+		tdata1 |= CSR_ICOUNT_U;
+
+	/* Find a trigger that isn't in use by us and supports icount. Whatever was
+	 * in it before is put back afterwards. */
+	unsigned i;
+	uint64_t tdata1_old = 0;
+	for (i = 0; i < r->trigger_count[hartid]; i++) {
+		if (r->trigger_unique_id[i] != -1)
+			continue;
+		riscv_set_register(target, GDB_REGNO_TSELECT, i);
+		if (riscv_get_register(target, &tdata1_old, GDB_REGNO_TDATA1) != ERROR_OK)
+			return ERROR_FAIL;
+		riscv_set_register(target, GDB_REGNO_TDATA1, tdata1);
+		uint64_t tdata1_rb;
+		if (riscv_get_register(target, &tdata1_rb, GDB_REGNO_TDATA1) != ERROR_OK)
+			return ERROR_FAIL;
+		if (tdata1_rb == tdata1)
+			break;
+		LOG_DEBUG("trigger %d doesn't support icount; tdata1=0x%" PRIx64, i,
+				tdata1_rb);
+		riscv_set_register(target, GDB_REGNO_TDATA1, tdata1_old);
+	}
+	if (i == r->trigger_count[hartid]) {
+		riscv_set_register(target, GDB_REGNO_TSELECT, tselect);
+		LOG_ERROR("Hart %d has no free trigger that can count instructions.",
+				hartid);
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	}
+
+	int result = target_resume(target, 1, 0, 0, 0);
+	int64_t start = timeval_ms();
+	while (result == ERROR_OK && target->state != TARGET_HALTED) {
+		if (timeval_ms() - start > riscv_command_timeout_sec * 1000) {
+			LOG_ERROR("Hart %d didn't halt within %d seconds of being told to "
+					"run %d instructions.", hartid, riscv_command_timeout_sec,
+					count);
+			target_halt(target);
+			target_poll(target);
+			result = ERROR_FAIL;
+			break;
+		}
+		result = target_poll(target);
+	}
+
+	uint64_t tdata1_rb = tdata1;
+	riscv_set_register(target, GDB_REGNO_TSELECT, i);
+	riscv_get_register(target, &tdata1_rb, GDB_REGNO_TDATA1);
+	/* The hardware may clear m, s and u instead of decrementing count from 1
+	 * to 0. */
+	*fired = get_field(tdata1_rb, CSR_ICOUNT_COUNT) == 0 ||
+		!(tdata1_rb & (CSR_ICOUNT_M | CSR_ICOUNT_S | CSR_ICOUNT_U));
+	riscv_set_register(target, GDB_REGNO_TDATA1, tdata1_old);
+	riscv_set_register(target, GDB_REGNO_TSELECT, tselect);
+
+	return result;
+}
+
+/* Single step the current hart until it reaches address, or value times. Only
+ * dpc is read between steps, and many steps go out in one batch. Every PC is
+ * written to trace, unless that is NULL. */
+static int riscv_step_fast(struct target *target, bool until_address,
+		uint64_t value, FILE *trace, uint64_t *steps)
+{
+	RISCV_INFO(r);
+	*steps = 0;
+
+	if (riscv_select_current_hart(target) != ERROR_OK)
+		return ERROR_FAIL;
+	riscv_invalidate_register_cache(target);
+	if (r->on_step(target) != ERROR_OK)
+		return ERROR_FAIL;
+
+	/* After the first step an execute breakpoint on the final address keeps
+	 * the hart there, so a batch may run past the point where it arrives.
+	 * Without one the hart has to be stepped one by one. A breakpoint the user
+	 * already has there does the same job, and is left in place. */
+	bool breakpoint = false;
+	bool breakpoint_tried = false;
+	bool breakpoint_ours = false;
+	uint64_t pcs[RISCV_DEFAULT_BATCH_SIZE_MAX];
+	unsigned max_chunk = MIN(r->batch_size, ARRAY_SIZE(pcs));
+	unsigned chunk = 1;
+	bool done = false;
+	int result = ERROR_OK;
+	while (!done) {
+		uint32_t n = chunk;
+		if (until_address) {
+			if (!breakpoint)
+				n = 1;
+			if (*steps >= RISCV_STEP_UNTIL_MAX_STEPS) {
+				LOG_ERROR("Hart didn't reach 0x%" PRIx64 " in %d steps.", value,
+						RISCV_STEP_UNTIL_MAX_STEPS);
+				result = ERROR_FAIL;
+				break;
+			}
+		} else {
+			n = MIN(n, value - *steps);
+		}
+
+		uint32_t stepped, resumed;
+		result = r->step_batch(target, n, pcs, &stepped, &resumed);
+		if (result != ERROR_OK)
+			break;
+		if (resumed == stepped + 1) {
+			/* The last step happened, but its dpc couldn't be read. The hart
+			 * is still where that step left it. */
+			riscv_invalidate_register_cache(target);
+			result = riscv_get_register(target, &pcs[stepped], GDB_REGNO_PC);
+			if (result != ERROR_OK)
+				break;
+			stepped++;
+		} else if (resumed > stepped) {
+			LOG_WARNING("Lost track of %d steps after step %" PRIu64 ".",
+					resumed - stepped, *steps + stepped);
+		}
+
+		for (uint32_t i = 0; i < stepped && !done; i++) {
+			(*steps)++;
+			if (trace)
+				fprintf(trace, "0x%" PRIx64 "\n", pcs[i]);
+			if (until_address)
+				done = pcs[i] == value;
+			else
+				done = *steps == value;
+		}
+
+		/* In count mode the hart is now past the steps that were seen, so
+		 * the count can't be trusted anymore. Steps that didn't happen at
+		 * all are simply tried again. */
+		if (!until_address && resumed > stepped) {
+			LOG_ERROR("Stopped counting after %" PRIu64 " of %" PRIu64 " steps.",
+					*steps, value);
+			result = ERROR_FAIL;
+			break;
+		}
+
+		chunk = stepped == n ? MIN(2 * chunk, max_chunk) : 1;
+		if (until_address && !breakpoint_tried && !done) {
+			breakpoint_tried = true;
+			if (breakpoint_find(target, value)) {
+				breakpoint = true;
+			} else {
+				breakpoint_ours = breakpoint_add(target, value, 4, BKPT_HARD) == ERROR_OK;
+				breakpoint = breakpoint_ours;
+			}
+		}
+	}
+
+	if (breakpoint_ours)
+		breakpoint_remove(target, value);
+
+	riscv_invalidate_register_cache(target);
+	r->on_halt(target);
+	target->state = TARGET_RUNNING;
+	target_call_event_callbacks(target, TARGET_EVENT_RESUMED);
+	target->state = TARGET_HALTED;
+	target->debug_reason = DBG_REASON_SINGLESTEP;
+	target_call_event_callbacks(target, TARGET_EVENT_HALTED);
+
+	return result;
+}
+
+COMMAND_HANDLER(riscv_step_until)
+{
+	struct target *target = get_current_target(CMD_CTX);
+	RISCV_INFO(r);
+
+	if (CMD_ARGC < 2 || CMD_ARGC > 3)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	if (target->state != TARGET_HALTED) {
+		LOG_ERROR("Target not halted.");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	uint64_t value;
+	COMMAND_PARSE_NUMBER(u64, CMD_ARGV[1], value);
+	int64_t start = timeval_ms();
+	uint64_t steps = 0;
+	int result;
+
+	if (!strcmp(CMD_ARGV[0], "icount")) {
+		if (CMD_ARGC != 2)
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		result = ERROR_OK;
+		bool fired = true;
+		while (result == ERROR_OK && fired && steps < value) {
+			unsigned n = MIN(value - steps,
+					CSR_ICOUNT_COUNT >> CSR_ICOUNT_COUNT_OFFSET);
+			result = riscv_run_icount(target, n, &fired);
+			if (fired)
+				steps += n;
+		}
+		if (!fired)
+			LOG_INFO("Hart halted before the instruction count was reached.");
+	} else {
+		bool until_address;
+		if (!strcmp(CMD_ARGV[0], "address"))
+			until_address = true;
+		else if (!strcmp(CMD_ARGV[0], "count"))
+			until_address = false;
+		else
+			return ERROR_COMMAND_SYNTAX_ERROR;
+
+		if (!r->step_batch) {
+			LOG_ERROR("This target does not support this command (may implement "
+					"an older version of the spec).");
+			return ERROR_FAIL;
+		}
+		if (!until_address && value == 0)
+			return ERROR_OK;
+
+		FILE *trace = NULL;
+		if (CMD_ARGC == 3) {
+			trace = fopen(CMD_ARGV[2], "w");
+			if (!trace) {
+				LOG_ERROR("Couldn't open %s: %s", CMD_ARGV[2], strerror(errno));
+				return ERROR_FAIL;
+			}
+		}
+		result = riscv_step_fast(target, until_address, value, trace, &steps);
+		if (trace)
+			fclose(trace);
+	}
+
+	riscv_reg_t pc = 0;
+	riscv_get_register(target, &pc, GDB_REGNO_PC);
+	command_print(CMD_CTX, "%" PRIu64 " instructions in %" PRId64 " ms; pc=0x%"
+			PRIx64, steps, timeval_ms() - start, pc);
+	return result;
+}
+
+COMMAND_HANDLER(riscv_flush_registers)
+{
+	struct target *target = get_current_target(CMD_CTX);
+
+	if (CMD_ARGC != 0) {
+		LOG_ERROR("Command does not take any parameters.");
+		return ERROR_COMMAND_SYNTAX_ERROR;
+	}
+
+	if (target->reg_cache)
+		riscv_flush_register_cache(target);
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(riscv_stats)
+{
+	struct target *target = get_current_target(CMD_CTX);
+	RISCV_INFO(r);
+	bool machine = false;
+
+	if (CMD_ARGC > 1) {
+		LOG_ERROR("Command takes at most one argument");
+		return ERROR_COMMAND_SYNTAX_ERROR;
+	} else if (CMD_ARGC == 1) {
+		if (!strcmp(CMD_ARGV[0], "reset")) {
+			memset(&r->stats, 0, sizeof(r->stats));
+			return ERROR_OK;
+		} else if (!strcmp(CMD_ARGV[0], "machine")) {
+			machine = true;
+		} else {
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		}
+	}
+
+	const struct riscv_stats *s = &r->stats;
+	const struct {
+		const char *key;
+		const char *description;
+		uint64_t value;
+	} counters[] = {
+		{ "dmi_scans", "DMI scans", s->dmi_scans },
+		{ "dmi_busy", "DMI scans that returned busy", s->dmi_busy },
+		{ "batches", "Batches", s->batches },
+		{ "batch_scans", "Scans in batches", s->batch_scans },
+		{ "batch_busy", "Batch scans that returned busy", s->batch_busy },
+		{ "dmi_busy_delay_increases", "DMI busy delay increases",
+			s->dmi_busy_delay_increases },
+		{ "ac_busy_delay_increases", "Abstract command busy delay increases",
+			s->ac_busy_delay_increases },
+		{ "sb_write_bytes", "Bytes written through the system bus",
+			s->sb_write_bytes },
+		{ "sb_write_us", "Time spent writing through the system bus (us)",
+			s->sb_write_us },
+		{ "progbuf_write_bytes", "Bytes written through the program buffer",
+			s->progbuf_write_bytes },
+		{ "progbuf_write_us", "Time spent writing through the program buffer (us)",
+			s->progbuf_write_us },
+	};
+
+	for (unsigned i = 0; i < DIM(counters); i++) {
+		if (machine)
+			command_print(CMD_CTX, "%s %" PRIu64, counters[i].key, counters[i].value);
+		else
+			command_print(CMD_CTX, "%s: %" PRIu64, counters[i].description,
+					counters[i].value);
+	}
+	if (!machine) {
+		if (s->sb_write_us)
+			command_print(CMD_CTX, "System bus write throughput: %" PRIu64 " KiB/s",
+					s->sb_write_bytes * 1000000 / 1024 / s->sb_write_us);
+		if (s->progbuf_write_us)
+			command_print(CMD_CTX, "Program buffer write throughput: %" PRIu64
+					" KiB/s", s->progbuf_write_bytes * 1000000 / 1024 /
+					s->progbuf_write_us);
+	}
+	if (machine)
+		command_print(CMD_CTX, "batch_size %u", r->batch_size);
+	else
+		command_print(CMD_CTX, "Program buffer batch size: %u (limits %u-%u)",
+				r->batch_size, r->batch_size_min, r->batch_size_max);
+	riscv_stats_print_histogram(CMD_CTX, machine ? "dmi_scan_latency" :
+			"DMI scan latency", s->dmi_scan_latency, machine);
+	riscv_stats_print_histogram(CMD_CTX, machine ? "batch_latency" :
+			"Batch latency", s->batch_latency, machine);
+
+	return ERROR_OK;
+}
+
 static const struct command_registration riscv_exec_command_handlers[] = {
 	{
 		.name = "test_compliance",
@@ -2245,6 +3590,69 @@ static const struct command_registration riscv_exec_command_handlers[] = {
 		.help = "When on, prefer to use System Bus Access to access memory. "
 			"When off, prefer to use the Program Buffer to access memory."
 	},
+	{
+		.name = "flush_registers",
+		.handler = riscv_flush_registers,
+		.mode = COMMAND_EXEC,
+		.usage = "riscv flush_registers",
+		.help = "Forget every cached register value, including the ones that "
+			"are normally kept across resumes, like misa and mhartid."
+	},
+	{
+		.name = "step_until",
+		.handler = riscv_step_until,
+		.mode = COMMAND_EXEC,
+		.usage = "riscv step_until address|count|icount value [trace_file]",
+		.help = "Single step the current hart until it reaches an address or "
+			"for a number of instructions, reading only the PC between steps. "
+			"With icount an instruction count trigger is used instead. The "
+			"PCs can be written to a trace file."
+	},
+	{
+		.name = "set_batch_size",
+		.handler = riscv_set_batch_size,
+		.mode = COMMAND_ANY,
+		.usage = "riscv set_batch_size [min [max]]",
+		.help = "Set the limits for the number of data accesses per batch in "
+			"program buffer memory reads and writes. With only min the size "
+			"is fixed."
+	},
+	{
+		.name = "set_parallel_read",
+		.handler = riscv_set_parallel_read,
+		.mode = COMMAND_ANY,
+		.usage = "riscv set_parallel_read on|off",
+		.help = "When on, split large memory reads through the program buffer "
+			"between the halted harts of an SMP group that sit behind "
+			"different Debug Modules."
+	},
+	{
+		.name = "set_semihosting_buffer",
+		.handler = riscv_set_semihosting_buffer,
+		.mode = COMMAND_ANY,
+		.usage = "riscv set_semihosting_buffer off|size",
+		.help = "Set the number of bytes of semihosting SYS_WRITE output that "
+			"may be buffered on the host while the hart keeps running."
+	},
+	{
+		.name = "set_pc_sample_address",
+		.handler = riscv_set_pc_sample_address,
+		.mode = COMMAND_ANY,
+		.usage = "riscv set_pc_sample_address off|address [4|8]",
+		.help = "Set the address of a memory-mapped register that reads as "
+			"the PC of the hart while it's running, so profiling can sample "
+			"it over the system bus instead of halting the hart."
+	},
+	{
+		.name = "memory_sample",
+		.handler = riscv_memory_sample,
+		.mode = COMMAND_EXEC,
+		.usage = "riscv memory_sample [add address [1|2|4|8]|clear|"
+			"start interval_ms file|port name|stop]",
+		.help = "Periodically read a set of addresses over the system bus "
+			"while the harts run, and write the timestamped values to a file "
+			"or stream them to a TCP port."
+	},
 	{
 		.name = "set_enable_virtual",
 		.handler = riscv_set_enable_virtual,
@@ -2350,6 +3758,25 @@ static const struct command_registration riscv_exec_command_handlers[] = {
 			"(optional) to indicate Bscan Tunnel Type {0:(default) NESTED_TAP , "
 			"1: DATA_REGISTER}"
 	},
+	{
+		.name = "delay_profile",
+		.handler = riscv_delay_profile,
+		.mode = COMMAND_ANY,
+		.usage = "riscv delay_profile load|save filename | riscv delay_profile export",
+		.help = "Load learned DMI/abstract command/system bus delays from a "
+			"profile file, save the current delays to one, or print them. "
+			"Profiles are keyed by IDCODE and adapter speed."
+	},
+	{
+		.name = "stats",
+		.handler = riscv_stats,
+		.mode = COMMAND_ANY,
+		.usage = "riscv stats [reset|machine]",
+		.help = "Show counters and latency histograms for the debug transport "
+			"traffic of the current target. 'reset' clears them. 'machine' "
+			"prints one 'key value' pair per line, with histograms as a list "
+			"of bucket counts."
+	},
 	COMMAND_REGISTRATION_DONE
 };
 
@@ -2426,6 +3853,85 @@ unsigned riscv_address_bits(struct target *target)
 	return riscv_xlen(target);
 }
 
+/* Number of samples that are taken at once. */
+#define RISCV_PROFILING_CHUNK 64
+
+static int riscv_profiling(struct target *target, uint32_t *samples,
+		uint32_t max_num_samples, uint32_t *num_samples, uint32_t seconds)
+{
+	RISCV_INFO(r);
+	struct timeval timeout, now;
+	int retval = ERROR_OK;
+
+	bool use_address = riscv_pc_sample_size && r->sample_memory;
+	if (!use_address && !r->sample_pc)
+		return target_profiling_default(target, samples, max_num_samples,
+				num_samples, seconds);
+
+	gettimeofday(&timeout, NULL);
+	timeval_add_time(&timeout, seconds, 0);
+
+	/* Make sure the target is running */
+	target_poll(target);
+	if (target->state == TARGET_HALTED)
+		retval = target_resume(target, 1, 0, 0, 0);
+	if (retval != ERROR_OK) {
+		LOG_ERROR("Error while resuming target");
+		return retval;
+	}
+	if (riscv_select_current_hart(target) != ERROR_OK)
+		return ERROR_FAIL;
+
+	if (use_address)
+		LOG_INFO("Starting profiling. Sampling 0x%" TARGET_PRIxADDR
+				" as fast as we can...", riscv_pc_sample_address);
+	else
+		LOG_INFO("Starting profiling. Halting and resuming the hart as fast as "
+				"we can...");
+
+	uint32_t sample_count = 0;
+	while (sample_count < max_num_samples) {
+		uint32_t chunk = MIN(max_num_samples - sample_count, RISCV_PROFILING_CHUNK);
+		uint32_t sampled = 0;
+
+		if (use_address) {
+			uint8_t buffer[RISCV_PROFILING_CHUNK * 8];
+			retval = r->sample_memory(target, riscv_pc_sample_address,
+					riscv_pc_sample_size, chunk, buffer);
+			if (retval == ERROR_OK) {
+				for (uint32_t i = 0; i < chunk; i++)
+					samples[sample_count + i] = buf_get_u32(buffer +
+							i * riscv_pc_sample_size, 0, 32);
+				sampled = chunk;
+			}
+		} else {
+			uint64_t pcs[RISCV_PROFILING_CHUNK];
+			retval = r->sample_pc(target, chunk, pcs, &sampled);
+			for (uint32_t i = 0; i < sampled; i++)
+				samples[sample_count + i] = pcs[i];
+		}
+
+		if (retval == ERROR_TARGET_RESOURCE_NOT_AVAILABLE && sample_count == 0) {
+			LOG_INFO("Fast sampling is not available on this target.");
+			return target_profiling_default(target, samples, max_num_samples,
+					num_samples, seconds);
+		}
+		if (retval != ERROR_OK) {
+			LOG_ERROR("Error while sampling the PC");
+			break;
+		}
+		sample_count += sampled;
+
+		gettimeofday(&now, NULL);
+		if (timeval_compare(&now, &timeout) >= 0)
+			break;
+	}
+
+	LOG_INFO("Profiling completed. %" PRIu32 " samples.", sample_count);
+	*num_samples = sample_count;
+	return retval;
+}
+
 struct target_type riscv_target = {
 	.name = "riscv",
 
@@ -2448,6 +3954,8 @@ struct target_type riscv_target = {
 
 	.checksum_memory = riscv_checksum_memory,
 
+	.profiling = riscv_profiling,
+
 	.get_gdb_reg_list = riscv_get_gdb_reg_list,
 	.get_gdb_reg_list_noread = riscv_get_gdb_reg_list_noread,
 
@@ -2461,6 +3969,8 @@ struct target_type riscv_target = {
 	.arch_state = riscv_arch_state,
 
 	.run_algorithm = riscv_run_algorithm,
+	.start_algorithm = riscv_start_algorithm,
+	.wait_algorithm = riscv_wait_algorithm,
 
 	.commands = riscv_command_handlers,
 
@@ -2475,15 +3985,15 @@ void riscv_info_init(struct target *target, riscv_info_t *r)
 	r->dtm_version = 1;
 	r->registers_initialized = false;
 	r->current_hartid = target->coreid;
+	r->batch_size_min = riscv_batch_size_min;
+	r->batch_size_max = riscv_batch_size_max;
+	r->batch_size = MIN(MAX(RISCV_DEFAULT_BATCH_SIZE, riscv_batch_size_min),
+			riscv_batch_size_max);
 
 	memset(r->trigger_unique_id, 0xff, sizeof(r->trigger_unique_id));
 
-	for (size_t h = 0; h < RISCV_MAX_HARTS; ++h) {
+	for (size_t h = 0; h < RISCV_MAX_HARTS; ++h)
 		r->xlen[h] = -1;
-
-		for (size_t e = 0; e < RISCV_MAX_REGISTERS; ++e)
-			r->valid_saved_registers[h][e] = false;
-	}
 }
 
 static int riscv_resume_go_all_harts(struct target *target)
@@ -2591,6 +4101,88 @@ bool riscv_rtos_enabled(const struct target *target)
 	return target->rtos && target->rtos->type == &riscv_rtos;
 }
 
+enum riscv_reg_volatility riscv_reg_volatility(enum gdb_regno number)
+{
+	if (number <= GDB_REGNO_XPR31 ||
+			(number >= GDB_REGNO_FPR0 && number <= GDB_REGNO_FPR31) ||
+			number == GDB_REGNO_PC)
+		return RISCV_REG_HALTED;
+	/* Identification registers. misa is writable, but software that changes
+	 * it while being debugged is rare enough to need a manual flush. */
+	if (number == GDB_REGNO_MISA ||
+			number == GDB_REGNO_CSR0 + CSR_MVENDORID ||
+			number == GDB_REGNO_CSR0 + CSR_MARCHID ||
+			number == GDB_REGNO_CSR0 + CSR_MIMPID ||
+			number == GDB_REGNO_CSR0 + CSR_MHARTID)
+		return RISCV_REG_STICKY;
+	/* CSRs (and possibly other extension) registers may change value at any
+	 * time. */
+	return RISCV_REG_VOLATILE;
+}
+
+static void riscv_invalidate_registers(struct target *target, bool sticky)
+{
+	RISCV_INFO(r);
+
+	LOG_DEBUG("[%d] sticky=%d", target->coreid, sticky);
+	unsigned num_regs = target->reg_cache->num_regs;
+	for (unsigned i = 0; i < num_regs; ++i) {
+		struct reg *reg = &target->reg_cache->reg_list[i];
+		if (sticky || riscv_reg_volatility(i) != RISCV_REG_STICKY) {
+			reg->valid = false;
+			reg->dirty = false;
+		}
+	}
+	if (r->reg_cache_valid) {
+		for (unsigned h = 0; h < r->reg_cache_harts; h++) {
+			for (unsigned i = 0; i < num_regs; ++i) {
+				if (sticky || riscv_reg_volatility(i) != RISCV_REG_STICKY)
+					r->reg_cache_valid[h * num_regs + i] = false;
+			}
+		}
+	}
+
+	r->registers_initialized = true;
+}
+
+void riscv_invalidate_register_cache(struct target *target)
+{
+	riscv_invalidate_registers(target, false);
+}
+
+void riscv_flush_register_cache(struct target *target)
+{
+	riscv_invalidate_registers(target, true);
+}
+
+/* Point the register cache at the values of hartid, keeping the valid flags
+ * of the hart that was shown before. */
+static void riscv_switch_register_cache(struct target *target, int hartid)
+{
+	RISCV_INFO(r);
+
+	if (hartid < 0 || (unsigned) hartid >= r->reg_cache_harts) {
+		/* Nowhere to keep its values. Even the sticky ones differ between
+		 * harts. */
+		riscv_flush_register_cache(target);
+		return;
+	}
+	if ((unsigned) hartid == r->reg_cache_hart)
+		return;
+
+	unsigned num_regs = target->reg_cache->num_regs;
+	bool *old_valid = r->reg_cache_valid + r->reg_cache_hart * num_regs;
+	bool *new_valid = r->reg_cache_valid + hartid * num_regs;
+	uint64_t *new_values = r->reg_cache_values + hartid * num_regs;
+	for (unsigned i = 0; i < num_regs; ++i) {
+		struct reg *reg = &target->reg_cache->reg_list[i];
+		old_valid[i] = reg->valid;
+		reg->valid = new_valid[i];
+		reg->value = &new_values[i];
+	}
+	r->reg_cache_hart = hartid;
+}
+
 int riscv_set_current_hartid(struct target *target, int hartid)
 {
 	RISCV_INFO(r);
@@ -2607,25 +4199,11 @@ int riscv_set_current_hartid(struct target *target, int hartid)
 	/* This might get called during init, in which case we shouldn't be
 	 * setting up the register cache. */
 	if (target_was_examined(target) && riscv_rtos_enabled(target))
-		riscv_invalidate_register_cache(target);
+		riscv_switch_register_cache(target, hartid);
 
 	return ERROR_OK;
 }
 
-void riscv_invalidate_register_cache(struct target *target)
-{
-	RISCV_INFO(r);
-
-	LOG_DEBUG("[%d]", target->coreid);
-	register_cache_invalidate(target->reg_cache);
-	for (size_t i = 0; i < target->reg_cache->num_regs; ++i) {
-		struct reg *reg = &target->reg_cache->reg_list[i];
-		reg->valid = false;
-	}
-
-	r->registers_initialized = true;
-}
-
 int riscv_current_hartid(const struct target *target)
 {
 	RISCV_INFO(r);
@@ -2748,6 +4326,20 @@ int riscv_write_debug_buffer(struct target *target, int index, riscv_insn_t insn
 	return ERROR_OK;
 }
 
+int riscv_write_debug_program(struct target *target, unsigned count,
+		const riscv_insn_t *insns)
+{
+	RISCV_INFO(r);
+	if (r->write_debug_program)
+		return r->write_debug_program(target, count, insns);
+
+	for (unsigned i = 0; i < count; ++i) {
+		if (riscv_write_debug_buffer(target, i, insns[i]) != ERROR_OK)
+			return ERROR_FAIL;
+	}
+	return ERROR_OK;
+}
+
 riscv_insn_t riscv_read_debug_buffer(struct target *target, int index)
 {
 	RISCV_INFO(r);
@@ -2978,11 +4570,7 @@ static int register_get(struct reg *reg)
 	if (result != ERROR_OK)
 		return result;
 	buf_set_u64(reg->value, 0, reg->size, value);
-	/* CSRs (and possibly other extension) registers may change value at any
-	 * time. */
-	if (reg->number <= GDB_REGNO_XPR31 ||
-			(reg->number >= GDB_REGNO_FPR0 && reg->number <= GDB_REGNO_FPR31) ||
-			reg->number == GDB_REGNO_PC)
+	if (riscv_reg_volatility(reg->number) != RISCV_REG_VOLATILE)
 		reg->valid = true;
 	LOG_DEBUG("[%d]{%d} read 0x%" PRIx64 " from %s (valid=%d)",
 			target->coreid, riscv_current_hartid(target), value, reg->name,
@@ -3001,11 +4589,7 @@ static int register_set(struct reg *reg, uint8_t *buf)
 			target->coreid, riscv_current_hartid(target), value, reg->name,
 			reg->valid);
 	struct reg *r = &target->reg_cache->reg_list[reg->number];
-	/* CSRs (and possibly other extension) registers may change value at any
-	 * time. */
-	if (reg->number <= GDB_REGNO_XPR31 ||
-			(reg->number >= GDB_REGNO_FPR0 && reg->number <= GDB_REGNO_FPR31) ||
-			reg->number == GDB_REGNO_PC)
+	if (riscv_reg_volatility(reg->number) != RISCV_REG_VOLATILE)
 		r->valid = true;
 	memcpy(r->value, buf, (r->size + 7) / 8);
 
@@ -3064,6 +4648,23 @@ int riscv_init_registers(struct target *target)
 		calloc(target->reg_cache->num_regs, max_reg_name_len);
 	char *reg_name = info->reg_names;
 
+	/* In RTOS mode every hart gets its own set of values. */
+	unsigned harts = 1;
+	info->reg_cache_hart = 0;
+	if (riscv_rtos_enabled(target)) {
+		harts = riscv_count_harts(target);
+		info->reg_cache_hart = info->current_hartid;
+	}
+	free(info->reg_cache_values);
+	info->reg_cache_values = calloc(target->reg_cache->num_regs * harts,
+			sizeof(*info->reg_cache_values));
+	free(info->reg_cache_valid);
+	info->reg_cache_valid = calloc(target->reg_cache->num_regs * harts,
+			sizeof(*info->reg_cache_valid));
+	if (!info->reg_cache_values || !info->reg_cache_valid)
+		return ERROR_FAIL;
+	info->reg_cache_harts = harts;
+
 	static struct reg_feature feature_cpu = {
 		.name = "org.gnu.gdb.riscv.cpu"
 	};
@@ -3506,7 +5107,8 @@ int riscv_init_registers(struct target *target)
 		reg_name += strlen(reg_name) + 1;
 		assert(reg_name < info->reg_names + target->reg_cache->num_regs *
 				max_reg_name_len);
-		r->value = &info->reg_cache_values[number];
+		r->value = &info->reg_cache_values[info->reg_cache_hart *
+			target->reg_cache->num_regs + number];
 	}
 
 	return ERROR_OK;
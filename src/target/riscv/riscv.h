@@ -7,9 +7,7 @@ struct riscv_program;
 #include "opcodes.h"
 #include "gdb_regs.h"
 
-/* The register cache is statically allocated. */
 #define RISCV_MAX_HARTS 32
-#define RISCV_MAX_REGISTERS 5000
 #define RISCV_MAX_TRIGGERS 32
 #define RISCV_MAX_HWBPS 16
 
@@ -40,6 +38,75 @@ typedef struct {
 	unsigned custom_number;
 } riscv_reg_info_t;
 
+/* Delays learned while talking to the debug module, in run-test/idle cycles.
+ * See "riscv delay_profile". */
+struct riscv_delays {
+	int dmi_busy;
+	int ac_busy;
+	int bus_master_read;
+	int bus_master_write;
+};
+
+/* Number of data accesses per batch in program buffer memory reads and
+ * writes, and its default limits. See "riscv set_batch_size". */
+#define RISCV_DEFAULT_BATCH_SIZE	32
+#define RISCV_DEFAULT_BATCH_SIZE_MIN	8
+#define RISCV_DEFAULT_BATCH_SIZE_MAX	256
+
+/* Latencies are counted in buckets of powers of two microseconds. Bucket 0
+ * counts everything below 2us, and the last bucket everything above. */
+#define RISCV_STATS_LATENCY_BUCKETS 20
+
+/* Counters for the debug transport traffic of a target, shown by
+ * "riscv stats". */
+struct riscv_stats {
+	/* Individual DMI scans, and how many of them returned busy. */
+	uint64_t dmi_scans;
+	uint64_t dmi_busy;
+	/* Batches run, the scans in them, and how many of those returned busy. */
+	uint64_t batches;
+	uint64_t batch_scans;
+	uint64_t batch_busy;
+	/* Number of times the learned delays were increased. */
+	uint64_t dmi_busy_delay_increases;
+	uint64_t ac_busy_delay_increases;
+	/* Time spent in jtag_execute_queue() by individual scans and batches. */
+	uint64_t dmi_scan_latency[RISCV_STATS_LATENCY_BUCKETS];
+	uint64_t batch_latency[RISCV_STATS_LATENCY_BUCKETS];
+	/* Bytes written to memory, and time spent writing them, through the
+	 * system bus and through the program buffer. */
+	uint64_t sb_write_bytes;
+	uint64_t sb_write_us;
+	uint64_t progbuf_write_bytes;
+	uint64_t progbuf_write_us;
+};
+
+/* How long a value in the register cache stays good. */
+enum riscv_reg_volatility {
+	/* Can change at any time, even while the hart is halted. Never cached. */
+	RISCV_REG_VOLATILE,
+	/* Only changes while the hart runs. Cached until it resumes. */
+	RISCV_REG_HALTED,
+	/* Never changes. Cached until reset or "riscv flush_registers". */
+	RISCV_REG_STICKY,
+};
+
+/* Maximum number of addresses that "riscv memory_sample" reads per target. */
+#define RISCV_SAMPLE_MAX	16
+
+/* Addresses that are read periodically while the harts run. See
+ * "riscv memory_sample". */
+typedef struct {
+	unsigned count;
+	target_addr_t address[RISCV_SAMPLE_MAX];
+	/* Size of each access in bytes: 1, 2, 4 or 8. */
+	unsigned size[RISCV_SAMPLE_MAX];
+	/* Sample sets that were read, and the ones that were dropped because
+	 * the DMI or the bus was busy. */
+	uint64_t taken;
+	uint64_t dropped;
+} riscv_sample_config_t;
+
 typedef struct {
 	unsigned dtm_version;
 
@@ -55,15 +122,16 @@ typedef struct {
 	 * every function than an actual */
 	int current_hartid;
 
-	/* Enough space to store all the registers we might need to save. */
-	/* FIXME: This should probably be a bunch of register caches. */
-	uint64_t saved_registers[RISCV_MAX_HARTS][RISCV_MAX_REGISTERS];
-	bool valid_saved_registers[RISCV_MAX_HARTS][RISCV_MAX_REGISTERS];
-
-	/* OpenOCD's register cache points into here. This is not per-hart because
-	 * we just invalidate the entire cache when we change which hart is
-	 * selected. */
-	uint64_t reg_cache_values[RISCV_MAX_REGISTERS];
+	/* OpenOCD's register cache points into here. Allocated by
+	 * riscv_init_registers() with one entry per register for every hart in
+	 * RTOS mode, so switching harts doesn't lose the values of the other
+	 * harts. reg_cache_valid holds the valid flags of the harts that aren't
+	 * shown in the register cache right now. */
+	uint64_t *reg_cache_values;
+	bool *reg_cache_valid;
+	unsigned reg_cache_harts;
+	/* The hart whose values the register cache shows. */
+	unsigned reg_cache_hart;
 
 	/* Single buffer that contains all register names, instead of calling
 	 * malloc for each register. Needs to be freed when reg_list is freed. */
@@ -97,6 +165,26 @@ typedef struct {
 	 * delays, causing them to be relearned. Used for testing. */
 	int reset_delays_wait;
 
+	/* Registers saved by riscv_start_algorithm(), which are restored by
+	 * riscv_wait_algorithm(). */
+	uint64_t algorithm_saved_pc;
+	uint64_t algorithm_saved_mstatus;
+	uint64_t algorithm_saved_regs[32];
+
+	struct riscv_stats stats;
+
+	/* A freed batch, kept for the next riscv_batch_alloc(). */
+	struct riscv_batch *batch_pool;
+
+	/* Number of data accesses per batch in the program buffer memory loops.
+	 * It grows while the target keeps up and shrinks when it reports busy,
+	 * staying within the limits set by "riscv set_batch_size". */
+	unsigned batch_size;
+	unsigned batch_size_min;
+	unsigned batch_size_max;
+
+	riscv_sample_config_t sample_config;
+
 	/* This target has been prepped and is ready to step/resume. */
 	bool prepped;
 	/* This target was selected using hasel. */
@@ -125,6 +213,9 @@ typedef struct {
 	enum riscv_halt_reason (*halt_reason)(struct target *target);
 	int (*write_debug_buffer)(struct target *target, unsigned index,
 			riscv_insn_t d);
+	/* Write a whole program to the debug buffer at once. Optional. */
+	int (*write_debug_program)(struct target *target, unsigned count,
+			const riscv_insn_t *insns);
 	riscv_insn_t (*read_debug_buffer)(struct target *target, unsigned index);
 	int (*execute_debug_buffer)(struct target *target);
 	int (*dmi_write_u64_bits)(struct target *target);
@@ -145,6 +236,46 @@ typedef struct {
 
 	/* How many harts are attached to the DM that this target is attached to? */
 	int (*hart_count)(struct target *target);
+
+	/* Read the given registers on the current hart all at once, setting
+	 * read[i] for each one that was read. Optional. */
+	int (*read_registers)(struct target *target, unsigned count,
+			const unsigned *numbers, uint64_t *values, bool *read);
+
+	/* Find out from a summary whether the given hart is halted. The summary
+	 * is read at most once per generation, so polling many harts with the
+	 * same generation is cheap. Optional. */
+	int (*halt_summary)(struct target *target, unsigned generation, int hartid,
+			bool *halted);
+
+	/* Halt (or resume) all the prepped targets in the SMP group of target at
+	 * once, marking the ones that were halted (or resumed) as selected.
+	 * Returns ERROR_TARGET_RESOURCE_NOT_AVAILABLE if halt_go() (or
+	 * resume_go()) should be called on every target instead. Optional. */
+	int (*smp_go)(struct target *target, bool halt);
+
+	/* Read address count times without halting any harts. Optional. */
+	int (*sample_memory)(struct target *target, target_addr_t address,
+			uint32_t size, uint32_t count, uint8_t *buffer);
+	/* Sample the PC of the current hart up to count times, as quickly as
+	 * possible. Optional. */
+	int (*sample_pc)(struct target *target, uint32_t count, uint64_t *samples,
+			uint32_t *sampled);
+	/* Read every address in config once over the system bus, in a single
+	 * batch and without halting any harts. Returns ERROR_WAIT if the set
+	 * should be dropped and tried again later. Optional. */
+	int (*sample_memory_set)(struct target *target,
+			const riscv_sample_config_t *config, uint64_t *values);
+	/* Single step the current hart up to count times, with dcsr.step already
+	 * set, as fast as possible. pcs[i] is the PC after step i, and stepped is
+	 * the number of steps whose PC was read. resumed is the number of steps
+	 * that happened, including any whose PC couldn't be read. */
+	int (*step_batch)(struct target *target, uint32_t count, uint64_t *pcs,
+			uint32_t *stepped, uint32_t *resumed);
+
+	/* Get/set the learned delays. Only implemented for 0.13 targets. */
+	void (*get_delays)(struct target *target, struct riscv_delays *delays);
+	void (*set_delays)(struct target *target, const struct riscv_delays *delays);
 } riscv_info_t;
 
 /* Wall-clock timeout for a command/access. Settable via RISC-V Target commands.*/
@@ -155,6 +286,14 @@ extern int riscv_reset_timeout_sec;
 
 extern bool riscv_prefer_sba;
 
+extern bool riscv_parallel_read;
+
+/* Return a timestamp for riscv_stats_add_latency(). */
+int64_t riscv_stats_time_us(void);
+/* Count the time since start_us in one of the latency histograms in struct
+ * riscv_stats. */
+void riscv_stats_add_latency(uint64_t *histogram, int64_t start_us);
+
 extern bool riscv_enable_virtual;
 
 /* Everything needs the RISC-V specific info structure, so here's a nice macro
@@ -263,6 +402,8 @@ size_t riscv_debug_buffer_size(struct target *target);
 
 riscv_insn_t riscv_read_debug_buffer(struct target *target, int index);
 int riscv_write_debug_buffer(struct target *target, int index, riscv_insn_t insn);
+int riscv_write_debug_program(struct target *target, unsigned count,
+		const riscv_insn_t *insns);
 int riscv_execute_debug_buffer(struct target *target);
 
 void riscv_fill_dmi_nop_u64(struct target *target, char *buf);
@@ -270,8 +411,12 @@ void riscv_fill_dmi_write_u64(struct target *target, char *buf, int a, uint64_t
 void riscv_fill_dmi_read_u64(struct target *target, char *buf, int a);
 int riscv_dmi_write_u64_bits(struct target *target);
 
-/* Invalidates the register cache. */
+/* Invalidates the register cache of every hart, except for sticky
+ * registers. */
 void riscv_invalidate_register_cache(struct target *target);
+/* Like riscv_invalidate_register_cache(), but also for sticky registers. */
+void riscv_flush_register_cache(struct target *target);
+enum riscv_reg_volatility riscv_reg_volatility(enum gdb_regno number);
 
 /* Returns TRUE when a hart is enabled in this target. */
 bool riscv_hart_enabled(struct target *target, int hartid);
@@ -288,7 +433,11 @@ int riscv_hit_watchpoint(struct target *target, struct watchpoint **hit_wp_addre
 
 int riscv_init_registers(struct target *target);
 
+/* Size of the buffer that coalesces semihosting SYS_WRITE calls. */
+extern unsigned riscv_semihosting_buffer_size;
+
 void riscv_semihosting_init(struct target *target);
 int riscv_semihosting(struct target *target, int *retval);
+void riscv_semihosting_flush(void);
 
 #endif
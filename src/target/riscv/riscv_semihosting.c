@@ -39,6 +39,9 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
+#include <unistd.h>
+
 #include "log.h"
 
 #include "target/target.h"
@@ -47,6 +50,32 @@
 
 static int riscv_semihosting_setup(struct target *target, int enable);
 static int riscv_semihosting_post_result(struct target *target);
+static int riscv_semihosting_write(struct target *target);
+
+/* How often pending SYS_WRITE data is written out while the hart runs. */
+#define RISCV_SEMIHOSTING_FLUSH_MS	100
+
+/* Size of the SYS_WRITE buffer. Settable via RISC-V Target commands. */
+unsigned riscv_semihosting_buffer_size = 64 * 1024;
+
+/*
+ * Data that SYS_WRITE already reported as written to the target, but that
+ * hasn't been handed to the host file yet. Only consecutive writes to the same
+ * file are coalesced, so the order of the output between files is kept.
+ */
+static struct {
+	int fd;
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+	/* A deferred write that failed is reported on the next write to fd. */
+	int failed_fd;
+	int failed_errno;
+	bool timer_registered;
+} pending_write = {
+	.fd = -1,
+	.failed_fd = -1
+};
 
 /**
  * Initialize RISC-V semihosting. Use common ARM code.
@@ -85,8 +114,12 @@ int riscv_semihosting(struct target *target, int *retval)
 
 	uint8_t tmp[12];
 
-	/* Read the current instruction, including the bracketing */
-	*retval = target_read_memory(target, dpc - 4, 2, 6, tmp);
+	/* Read the current instruction, including the bracketing. Use whole
+	 * words when they are aligned, which takes a single bulk access. */
+	if (dpc % 4 == 0)
+		*retval = target_read_memory(target, dpc - 4, 4, 3, tmp);
+	else
+		*retval = target_read_memory(target, dpc - 4, 2, 6, tmp);
 	if (*retval != ERROR_OK)
 		return 0;
 
@@ -133,7 +166,14 @@ int riscv_semihosting(struct target *target, int *retval)
 
 		/* Check for ARM operation numbers. */
 		if (0 <= semihosting->op && semihosting->op <= 0x31) {
-			*retval = semihosting_common(target);
+			if (semihosting->op == SEMIHOSTING_SYS_WRITE &&
+					!semihosting->is_fileio) {
+				*retval = riscv_semihosting_write(target);
+			} else {
+				/* Any other call may depend on the data written so far. */
+				riscv_semihosting_flush();
+				*retval = semihosting_common(target);
+			}
 			if (*retval != ERROR_OK) {
 				LOG_ERROR("Failed semihosting operation");
 				return 0;
@@ -192,3 +232,143 @@ static int riscv_semihosting_post_result(struct target *target)
 	riscv_set_register(target, GDB_REGNO_A0, semihosting->result);
 	return 0;
 }
+
+/**
+ * Hand the pending SYS_WRITE data to the host file. Errors can't be reported
+ * to the call that produced the data anymore, so they are logged and reported
+ * by the next write to the same file.
+ */
+void riscv_semihosting_flush(void)
+{
+	if (pending_write.size == 0)
+		return;
+
+	size_t done = 0;
+	while (done < pending_write.size) {
+		ssize_t result = write(pending_write.fd, pending_write.data + done,
+				pending_write.size - done);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0) {
+			LOG_ERROR("Failed to write %zu bytes of semihosting output to %d: %s",
+					pending_write.size - done, pending_write.fd,
+					result < 0 ? strerror(errno) : "nothing written");
+			pending_write.failed_fd = pending_write.fd;
+			pending_write.failed_errno = result < 0 ? errno : EIO;
+			break;
+		}
+		done += result;
+	}
+	LOG_DEBUG("write(%d, %zu)=%zu", pending_write.fd, pending_write.size, done);
+	pending_write.size = 0;
+}
+
+static int riscv_semihosting_timer(void *priv)
+{
+	riscv_semihosting_flush();
+	return ERROR_OK;
+}
+
+/**
+ * Handle SYS_WRITE. The data is read from the target in one block and added to
+ * the pending buffer, and the call reports success right away so the hart can
+ * resume. The host write happens later, when the buffer fills up, the output
+ * goes to another file, another call needs it, or the flush timer fires.
+ */
+static int riscv_semihosting_write(struct target *target)
+{
+	struct semihosting *semihosting = target->semihosting;
+	unsigned word_size = semihosting->word_size_bytes;
+	uint8_t fields[3 * 8];
+
+	/* Use 4-byte multiples to trigger fast memory access. */
+	int result = target_read_memory(target, semihosting->param, 4,
+			3 * word_size / 4, fields);
+	if (result != ERROR_OK)
+		return result;
+
+	int fd;
+	uint64_t addr;
+	uint64_t len;
+	if (word_size == 8) {
+		fd = target_buffer_get_u64(target, fields);
+		addr = target_buffer_get_u64(target, fields + 8);
+		len = target_buffer_get_u64(target, fields + 16);
+	} else {
+		fd = target_buffer_get_u32(target, fields);
+		addr = target_buffer_get_u32(target, fields + 4);
+		len = target_buffer_get_u32(target, fields + 8);
+	}
+
+	if (len > UINT32_MAX) {
+		LOG_ERROR("Semihosting write of 0x%" PRIx64 " bytes is too large.", len);
+		semihosting->result = len;
+		semihosting->sys_errno = EINVAL;
+		return semihosting->post_result(target);
+	}
+
+	if (fd != pending_write.fd)
+		riscv_semihosting_flush();
+
+	if (fd == pending_write.failed_fd) {
+		/* Report the error from a deferred write. */
+		pending_write.failed_fd = -1;
+		semihosting->result = len;
+		semihosting->sys_errno = pending_write.failed_errno;
+		return semihosting->post_result(target);
+	}
+
+	if (len > pending_write.capacity - pending_write.size &&
+			len <= riscv_semihosting_buffer_size) {
+		size_t capacity = MAX(pending_write.size + len,
+				MIN(2 * pending_write.capacity, riscv_semihosting_buffer_size));
+		uint8_t *data = realloc(pending_write.data, capacity);
+		if (data) {
+			pending_write.data = data;
+			pending_write.capacity = capacity;
+		}
+	}
+
+	if (len > pending_write.capacity - pending_write.size) {
+		/* Too large to buffer; write it out while the hart waits. */
+		riscv_semihosting_flush();
+		uint8_t *buf = malloc(len);
+		if (!buf) {
+			semihosting->result = -1;
+			semihosting->sys_errno = ENOMEM;
+			return semihosting->post_result(target);
+		}
+		result = target_read_buffer(target, addr, len, buf);
+		if (result != ERROR_OK) {
+			free(buf);
+			return result;
+		}
+		ssize_t written = write(fd, buf, len);
+		semihosting->sys_errno = errno;
+		LOG_DEBUG("write(%d, 0x%" PRIx64 ", %" PRIu64 ")=%zd", fd, addr, len, written);
+		free(buf);
+		/* The number of bytes that are NOT written. */
+		semihosting->result = written < 0 ? (int64_t)len : (int64_t)(len - written);
+		return semihosting->post_result(target);
+	}
+
+	result = target_read_buffer(target, addr, len,
+			pending_write.data + pending_write.size);
+	if (result != ERROR_OK)
+		return result;
+	LOG_DEBUG("buffered write(%d, 0x%" PRIx64 ", %" PRIu64 ")", fd, addr, len);
+	pending_write.fd = fd;
+	pending_write.size += len;
+
+	if (!pending_write.timer_registered) {
+		target_register_timer_callback(riscv_semihosting_timer,
+				RISCV_SEMIHOSTING_FLUSH_MS, TARGET_TIMER_TYPE_PERIODIC, NULL);
+		pending_write.timer_registered = true;
+	}
+
+	if (pending_write.size >= riscv_semihosting_buffer_size)
+		riscv_semihosting_flush();
+
+	semihosting->result = 0;
+	return semihosting->post_result(target);
+}
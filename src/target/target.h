@@ -651,6 +651,14 @@ int target_get_gdb_fileio_info(struct target *target, struct gdb_fileio_info *fi
  */
 int target_gdb_fileio_end(struct target *target, int retcode, int fileio_errno, bool ctrl_c);
 
+/**
+ * Collect PC samples by halting and resuming the target as often as possible.
+ * This is what targets without a profiling method of their own use, and
+ * targets that do have one can fall back to it.
+ */
+int target_profiling_default(struct target *target, uint32_t *samples,
+		uint32_t max_num_samples, uint32_t *num_samples, uint32_t seconds);
+
 /**
  * Return the highest accessible address for this target.
  */